@@ -0,0 +1,71 @@
+#include <benchmark/benchmark.h>
+
+#include <pirest/http_cors_filter.hpp>
+#include <pirest/http_rate_limit_filter.hpp>
+
+#include "../unit-test/allocation_counter.h"
+
+using namespace pirest;
+
+static std::string Origin(std::int64_t index) {
+  return "https://app" + std::to_string(index) + ".example.com";
+}
+
+// A cross origin GET through OnIncomingRequest and OnOutgingResponse.
+// range(0): allowed origins, the last one is sent.
+static void BM_CorsFilter(benchmark::State& state) {
+  std::vector<std::string> origins;
+  for (std::int64_t i = 0; i < state.range(0); ++i) {
+    origins.emplace_back(Origin(i));
+  }
+  HttpCorsFilter filter;
+  filter.set_allow_origins(origins)
+      .set_allow_methods({"GET", "POST", "PUT", "DELETE"})
+      .set_allow_headers({"Authorization", "Content-Type"})
+      .set_expose_headers({"X-Request-Id"})
+      .set_max_age(600);
+  HttpRequest req{boost::beast::http::verb::get, "/api/v1/users", 11};
+  req.set(boost::beast::http::field::origin, Origin(state.range(0) - 1));
+  HttpConnection::Ptr conn =
+      std::make_shared<RequestOnlyConnection>(std::move(req));
+  allocations = 0;
+  counting = true;
+  for (auto _ : state) {
+    auto result = filter.OnIncomingRequest(conn);
+    HttpResponseHeader resp;
+    filter.OnOutgingResponse(conn, resp);
+    benchmark::DoNotOptimize(result);
+    benchmark::DoNotOptimize(resp);
+  }
+  counting = false;
+  // Should be 0, the first iteration warms up the recycled header memory
+  state.counters["allocs"] = benchmark::Counter(
+      static_cast<double>(allocations.exchange(0)),
+      benchmark::Counter::kAvgIterations);
+  if (conn->allow_origin().empty()) {
+    state.SkipWithError("Origin not allowed");
+  }
+}
+
+BENCHMARK(BM_CorsFilter)->Arg(1)->Arg(16)->Arg(256);
+
+// Admitted requests through OnIncomingRequest, keyed by address.
+// range(0): distinct clients, taking turns in a scattered order.
+static void BM_RateLimitFilter(benchmark::State& state) {
+  auto keys = static_cast<std::uint32_t>(state.range(0));
+  HttpRateLimitFilter filter{keys};
+  // Never rejects, that would need a socket
+  filter.set_rate(1e9).set_burst(1000000);
+  HttpRequest req{boost::beast::http::verb::get, "/api/v1/users", 11};
+  auto conn = std::make_shared<RequestOnlyConnection>(std::move(req));
+  HttpConnection::Ptr base = conn;
+  std::uint32_t i = 0;
+  for (auto _ : state) {
+    conn->set_remote_address(
+        boost::asio::ip::address_v4{(i++ % keys) * 2654435761u});
+    auto result = filter.OnIncomingRequest(base);
+    benchmark::DoNotOptimize(result);
+  }
+}
+
+BENCHMARK(BM_RateLimitFilter)->Arg(1)->Arg(1024)->Arg(1 << 20);
@@ -0,0 +1,114 @@
+#include <benchmark/benchmark.h>
+
+#include <pirest/http_connection.hpp>
+#include <pirest/http_router.hpp>
+#include <regex>
+
+using namespace pirest;
+
+static void Handler(const HttpConnection::Ptr&, const std::string&) {}
+
+static void StaticHandler(const HttpConnection::Ptr&) {}
+
+static void QueryHandler(const HttpConnection::Ptr&, int, const std::string&,
+                         int) {}
+
+static std::string ResourcePath(std::int64_t index) {
+  return "/api/v1/resource" + std::to_string(index);
+}
+
+// range(0): number of parameterized routes, the last one is looked up
+static void BM_RouterFindRoute(benchmark::State& state) {
+  HttpRouter router;
+  for (std::int64_t i = 0; i < state.range(0); ++i) {
+    router.AddRoute(ResourcePath(i) + "/{id}", &Handler, {"GET"});
+  }
+  auto path = ResourcePath(state.range(0) - 1) + "/123";
+  HttpRouter::PathArgs path_args;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(router.FindRoute(path, path_args));
+  }
+}
+
+// The linear std::regex scan the router used before the route tree, kept as a
+// reference point.
+static void BM_RegexFindRoute(benchmark::State& state) {
+  std::vector<std::regex> routes;
+  for (std::int64_t i = 0; i < state.range(0); ++i) {
+    routes.emplace_back(ResourcePath(i) + "/([^/]*)",
+                        std::regex_constants::icase);
+  }
+  auto path = ResourcePath(state.range(0) - 1) + "/123";
+  std::smatch results;
+  for (auto _ : state) {
+    for (const auto& route : routes) {
+      if (std::regex_match(path, results, route)) {
+        break;
+      }
+    }
+    benchmark::DoNotOptimize(results);
+  }
+}
+
+// range(0): number of routes added, half static and half parameterized
+static void BM_RouterAddRoute(benchmark::State& state) {
+  for (auto _ : state) {
+    HttpRouter router;
+    for (std::int64_t i = 0; i < state.range(0); ++i) {
+      if (i % 2 == 0) {
+        router.AddRoute(ResourcePath(i), &StaticHandler, {"GET"});
+      } else {
+        router.AddRoute(ResourcePath(i) + "/{id}", &Handler, {"GET"});
+      }
+    }
+    benchmark::DoNotOptimize(router);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// Routing as the connection calls it: target parsing, lookup, argument
+// conversion and the handler call. range(0): routes of the same kind.
+static void RouterRouting(benchmark::State& state, const std::string& pattern,
+                          const std::string& target_suffix, bool query) {
+  HttpRouter router;
+  for (std::int64_t i = 0; i < state.range(0); ++i) {
+    if (query) {
+      router.AddRoute(ResourcePath(i) + pattern, &QueryHandler, {"GET"});
+    } else if (pattern.empty()) {
+      router.AddRoute(ResourcePath(i), &StaticHandler, {"GET"});
+    } else {
+      router.AddRoute(ResourcePath(i) + pattern, &Handler, {"GET"});
+    }
+  }
+  auto target = ResourcePath(state.range(0) - 1) + target_suffix;
+  HttpConnection::Ptr conn;
+  std::string method = "GET";
+  RouteError error;
+  for (auto _ : state) {
+    router.Routing(conn, method, target, error);
+    benchmark::DoNotOptimize(error);
+  }
+  if (error != RouteError::kNone) {
+    state.SkipWithError(RouteErrorMessage(error));
+  }
+}
+
+static void BM_RouterRoutingStatic(benchmark::State& state) {
+  RouterRouting(state, "", "", false);
+}
+
+static void BM_RouterRoutingParam(benchmark::State& state) {
+  RouterRouting(state, "/{id}", "/123", false);
+}
+
+static void BM_RouterRoutingQuery(benchmark::State& state) {
+  RouterRouting(state, "/{id}?name&age", "/123?name=hello%20kitty&age=18",
+                true);
+}
+
+BENCHMARK(BM_RouterFindRoute)->Arg(10)->Arg(100)->Arg(1000);
+BENCHMARK(BM_RegexFindRoute)->Arg(10)->Arg(100)->Arg(1000);
+BENCHMARK(BM_RouterAddRoute)->Arg(10)->Arg(100)->Arg(1000);
+BENCHMARK(BM_RouterRoutingStatic)->Arg(10)->Arg(100)->Arg(1000);
+BENCHMARK(BM_RouterRoutingParam)->Arg(10)->Arg(100)->Arg(1000);
+BENCHMARK(BM_RouterRoutingQuery)->Arg(10)->Arg(100)->Arg(1000);
@@ -0,0 +1,180 @@
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <chrono>
+#include <pirest/http_server.hpp>
+#include <thread>
+
+using namespace pirest;
+
+static void Ping(const HttpConnection::Ptr& conn) {
+  conn->Respond(boost::beast::http::status::ok, std::string{"pong"},
+                "text/plain");
+}
+
+// One keep-alive connection issuing requests back to back.
+static void RunClient(const boost::asio::ip::tcp::endpoint& endpoint,
+                      std::int64_t requests) {
+  boost::asio::io_context ctx;
+  boost::asio::ip::tcp::socket socket{ctx};
+  socket.connect(endpoint);
+  boost::beast::http::request<boost::beast::http::empty_body> req{
+      boost::beast::http::verb::get, "/ping", 11};
+  boost::beast::flat_buffer buffer;
+  for (std::int64_t i = 0; i < requests; ++i) {
+    boost::beast::http::write(socket, req);
+    boost::beast::http::response<boost::beast::http::string_body> resp;
+    boost::beast::http::read(socket, buffer, resp);
+  }
+}
+
+// A new connection for every request, the way a load balancer recycling
+// keep-alives looks to the server.
+static void RunShortClient(const boost::asio::ip::tcp::endpoint& endpoint,
+                           std::int64_t requests) {
+  boost::asio::io_context ctx;
+  boost::beast::http::request<boost::beast::http::empty_body> req{
+      boost::beast::http::verb::get, "/ping", 11};
+  req.keep_alive(false);
+  for (std::int64_t i = 0; i < requests; ++i) {
+    boost::asio::ip::tcp::socket socket{ctx};
+    socket.connect(endpoint);
+    boost::beast::http::write(socket, req);
+    boost::beast::flat_buffer buffer;
+    boost::beast::http::response<boost::beast::http::string_body> resp;
+    boost::beast::http::read(socket, buffer, resp);
+  }
+}
+
+// range(0): io threads of the server, range(1): concurrent client connections
+static void BM_ServerThroughput(benchmark::State& state) {
+  constexpr std::int64_t kRequestsPerClient = 200;
+  HttpPlainServer server;
+  server.setting().set_io_threads(static_cast<std::size_t>(state.range(0)));
+  server.HandleFunc("/ping", &Ping, {"GET"});
+  server.ListenAndServe("127.0.0.1", 0);
+  auto endpoint = server.local_endpoint();
+
+  for (auto _ : state) {
+    std::vector<std::thread> clients;
+    for (std::int64_t i = 0; i < state.range(1); ++i) {
+      clients.emplace_back(RunClient, endpoint, kRequestsPerClient);
+    }
+    for (auto& client : clients) {
+      client.join();
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(1) *
+                          kRequestsPerClient);
+}
+
+static const std::int64_t kMaxIoThreads =
+    std::max<std::int64_t>(std::thread::hardware_concurrency(), 1);
+
+BENCHMARK(BM_ServerThroughput)
+    ->ArgsProduct({benchmark::CreateRange(1, kMaxIoThreads, 2), {64}})
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+// range(0): io threads of the server, range(1): 1 for SO_REUSEPORT acceptors
+static void BM_ServerConnectionStorm(benchmark::State& state) {
+  constexpr std::int64_t kClients = 32;
+  constexpr std::int64_t kRequestsPerClient = 50;
+  HttpPlainServer server;
+  server.setting()
+      .set_io_threads(static_cast<std::size_t>(state.range(0)))
+      .set_reuse_port(state.range(1) != 0);
+  server.HandleFunc("/ping", &Ping, {"GET"});
+  server.ListenAndServe("127.0.0.1", 0);
+  auto endpoint = server.local_endpoint();
+
+  for (auto _ : state) {
+    std::vector<std::thread> clients;
+    for (std::int64_t i = 0; i < kClients; ++i) {
+      clients.emplace_back(RunShortClient, endpoint, kRequestsPerClient);
+    }
+    for (auto& client : clients) {
+      client.join();
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * kClients * kRequestsPerClient);
+}
+
+#ifdef SO_REUSEPORT
+static const std::vector<std::int64_t> kAcceptModes = {0, 1};
+#else
+static const std::vector<std::int64_t> kAcceptModes = {0};
+#endif
+
+BENCHMARK(BM_ServerConnectionStorm)
+    ->ArgsProduct({benchmark::CreateRange(1, kMaxIoThreads, 2), kAcceptModes})
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+// A closed-loop load generator: each client thread keeps one connection
+// with a single request in flight, recording the latency of each one.
+static void RunLatencyClient(const boost::asio::ip::tcp::endpoint& endpoint,
+                             std::int64_t requests,
+                             std::vector<std::chrono::nanoseconds>& latencies) {
+  boost::asio::io_context ctx;
+  boost::asio::ip::tcp::socket socket{ctx};
+  socket.connect(endpoint);
+  socket.set_option(boost::asio::ip::tcp::no_delay{true});
+  boost::beast::http::request<boost::beast::http::empty_body> req{
+      boost::beast::http::verb::get, "/ping", 11};
+  boost::beast::flat_buffer buffer;
+  for (std::int64_t i = 0; i < requests; ++i) {
+    auto start = std::chrono::steady_clock::now();
+    boost::beast::http::write(socket, req);
+    boost::beast::http::response<boost::beast::http::string_body> resp;
+    boost::beast::http::read(socket, buffer, resp);
+    latencies.emplace_back(std::chrono::steady_clock::now() - start);
+  }
+}
+
+// range(0): io threads of the server, range(1): client connections, each on
+// its own thread. Reports requests per second and latency percentiles.
+static void BM_ServerLatency(benchmark::State& state) {
+  constexpr std::int64_t kRequestsPerClient = 500;
+  HttpPlainServer server;
+  server.setting().set_io_threads(static_cast<std::size_t>(state.range(0)));
+  server.HandleFunc("/ping", &Ping, {"GET"});
+  server.ListenAndServe("127.0.0.1", 0);
+  auto endpoint = server.local_endpoint();
+
+  std::vector<std::vector<std::chrono::nanoseconds>> latencies(
+      static_cast<std::size_t>(state.range(1)));
+  for (auto _ : state) {
+    std::vector<std::thread> clients;
+    for (auto& client_latencies : latencies) {
+      clients.emplace_back(RunLatencyClient, endpoint, kRequestsPerClient,
+                           std::ref(client_latencies));
+    }
+    for (auto& client : clients) {
+      client.join();
+    }
+  }
+
+  std::vector<std::chrono::nanoseconds> all;
+  for (const auto& client_latencies : latencies) {
+    all.insert(all.end(), client_latencies.begin(), client_latencies.end());
+  }
+  std::sort(all.begin(), all.end());
+  auto percentile = [&all](double p) {
+    auto index = static_cast<std::size_t>(p * static_cast<double>(all.size()));
+    auto latency = all[std::min(index, all.size() - 1)];
+    return std::chrono::duration<double, std::micro>(latency).count();
+  };
+  state.counters["rps"] = benchmark::Counter(
+      static_cast<double>(all.size()), benchmark::Counter::kIsRate);
+  state.counters["p50_us"] = percentile(0.5);
+  state.counters["p90_us"] = percentile(0.9);
+  state.counters["p99_us"] = percentile(0.99);
+  state.counters["p999_us"] = percentile(0.999);
+  state.counters["max_us"] = percentile(1);
+}
+
+BENCHMARK(BM_ServerLatency)
+    ->ArgsProduct({benchmark::CreateRange(1, kMaxIoThreads, 2), {1, 16, 64}})
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
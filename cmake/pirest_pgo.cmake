@@ -0,0 +1,40 @@
+# Profile guided optimization. A GENERATE build writes profiles to
+# PIREST_PGO_DIR as its programs run, the pgo labeled tests train it with
+# the load benchmark. A USE build of the same binary directory optimizes
+# with them, GCC finds the profiles by object path.
+if(PIREST_PGO STREQUAL "OFF")
+  return()
+endif()
+if(NOT PIREST_PGO MATCHES "^(GENERATE|USE)$")
+  message(FATAL_ERROR "Unknown PIREST_PGO: ${PIREST_PGO}")
+endif()
+if(PIREST_PGO STREQUAL "GENERATE" AND NOT PIREST_BUILD_BENCHMARKS)
+  message(FATAL_ERROR "PIREST_PGO=GENERATE trains with the benchmarks")
+endif()
+
+if(CMAKE_CXX_COMPILER_ID STREQUAL "GNU")
+  if(PIREST_PGO STREQUAL "GENERATE")
+    # The io threads bump the counters concurrently
+    add_compile_options("-fprofile-generate=${PIREST_PGO_DIR}"
+                        -fprofile-update=atomic)
+    add_link_options("-fprofile-generate=${PIREST_PGO_DIR}")
+  else()
+    add_compile_options("-fprofile-use=${PIREST_PGO_DIR}"
+                        -fprofile-correction -Wno-missing-profile)
+    add_link_options("-fprofile-use=${PIREST_PGO_DIR}")
+  endif()
+elseif(CMAKE_CXX_COMPILER_ID MATCHES "Clang")
+  # Raw profiles are merged into one by the pirest_pgo_merge test
+  set(PIREST_PGO_PROFDATA "${PIREST_PGO_DIR}/default.profdata")
+  if(PIREST_PGO STREQUAL "GENERATE")
+    add_compile_options("-fprofile-generate=${PIREST_PGO_DIR}")
+    add_link_options("-fprofile-generate=${PIREST_PGO_DIR}")
+  else()
+    add_compile_options("-fprofile-use=${PIREST_PGO_PROFDATA}"
+                        -Wno-profile-instr-unprofiled
+                        -Wno-profile-instr-out-of-date)
+    add_link_options("-fprofile-use=${PIREST_PGO_PROFDATA}")
+  endif()
+else()
+  message(FATAL_ERROR "PIREST_PGO needs GCC or Clang")
+endif()
@@ -0,0 +1,9 @@
+# cmake -DLLVM_PROFDATA=... -DPGO_DIR=... -P pirest_pgo_merge.cmake
+file(GLOB raw_profiles "${PGO_DIR}/*.profraw")
+if(NOT raw_profiles)
+  message(FATAL_ERROR "No raw profiles in ${PGO_DIR}")
+endif()
+execute_process(
+  COMMAND "${LLVM_PROFDATA}" merge "-output=${PGO_DIR}/default.profdata"
+          ${raw_profiles}
+  COMMAND_ERROR_IS_FATAL ANY)
@@ -0,0 +1,115 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace pirest {
+
+// Caps the connections and the requests in flight of the servers sharing it.
+// A connection beyond max_connections is closed right after accept, before
+// anything is allocated for it, plain http ones get a canned 503 first. The
+// server then waits accept_backoff before it accepts again, the kernel holds
+// the connections meanwhile. A request beyond max_requests gets a canned 503
+// before the filters. A request is in flight until its response is queued.
+// The limits are soft, concurrent acceptors may overshoot by one each.
+class HttpAdmission {
+ public:
+  // 0 for no limit. Set before ListenAndServe.
+  HttpAdmission& set_max_connections(std::size_t val) noexcept {
+    max_connections_ = val;
+    return *this;
+  }
+
+  // 0 for no limit. Set before ListenAndServe.
+  HttpAdmission& set_max_requests(std::size_t val) noexcept {
+    max_requests_ = val;
+    return *this;
+  }
+
+  HttpAdmission& set_accept_backoff(std::chrono::milliseconds val) noexcept {
+    accept_backoff_ = val;
+    return *this;
+  }
+
+  std::chrono::milliseconds accept_backoff() const noexcept {
+    return accept_backoff_;
+  }
+
+  std::size_t connections() const noexcept {
+    return connections_.load(std::memory_order_relaxed);
+  }
+
+  std::size_t requests() const noexcept {
+    return requests_.load(std::memory_order_relaxed);
+  }
+
+  // Connections and requests turned away so far
+  std::uint64_t shed_connections() const noexcept {
+    return shed_connections_.load(std::memory_order_relaxed);
+  }
+
+  std::uint64_t shed_requests() const noexcept {
+    return shed_requests_.load(std::memory_order_relaxed);
+  }
+
+  // False when the connection just accepted must be shed
+  bool AdmitConnection() noexcept {
+    if (max_connections_ == 0 ||
+        connections_.load(std::memory_order_relaxed) < max_connections_) {
+      return true;
+    }
+    shed_connections_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  void OnConnect() noexcept {
+    connections_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void OnDisconnect() noexcept {
+    connections_.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  // Counts the request in unless max_requests are in flight
+  bool AdmitRequest() noexcept {
+    if (max_requests_ == 0) {
+      return true;
+    }
+    if (requests_.fetch_add(1, std::memory_order_relaxed) >= max_requests_) {
+      requests_.fetch_sub(1, std::memory_order_relaxed);
+      shed_requests_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    return true;
+  }
+
+  // For each request AdmitRequest counted in
+  void OnRequestDone() noexcept {
+    if (max_requests_ != 0) {
+      requests_.fetch_sub(1, std::memory_order_relaxed);
+    }
+  }
+
+  // The 503 both kinds of shedding send, serialized once
+  static const std::shared_ptr<const std::string>& ServiceUnavailable() {
+    static const auto response = std::make_shared<const std::string>(
+        "HTTP/1.1 503 Service Unavailable\r\n"
+        "Content-Length: 0\r\n"
+        "Retry-After: 1\r\n"
+        "\r\n");
+    return response;
+  }
+
+ private:
+  std::size_t max_connections_ = 0;
+  std::size_t max_requests_ = 0;
+  std::chrono::milliseconds accept_backoff_ = std::chrono::milliseconds(10);
+  alignas(64) std::atomic<std::size_t> connections_{0};
+  alignas(64) std::atomic<std::size_t> requests_{0};
+  std::atomic<std::uint64_t> shed_connections_{0};
+  std::atomic<std::uint64_t> shed_requests_{0};
+};
+
+}  // namespace pirest
@@ -0,0 +1,147 @@
+#pragma once
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace pirest {
+
+// Per-thread free lists of power-of-two blocks from 64 bytes to 4 KiB. A
+// connection stays on one io thread, so once a keep-alive connection is warm
+// its messages and handlers reuse the blocks freed by the previous request.
+class RecyclingMemory {
+ public:
+  static void* Allocate(std::size_t size) {
+    auto index = ClassIndex(size);
+    if (index == kClassNum) {
+      return ::operator new(size);
+    }
+    auto& list = Lists().classes[index];
+    if (list.head) {
+      auto block = list.head;
+      list.head = block->next;
+      --list.size;
+      return block;
+    }
+    return ::operator new(kMinBlockSize << index);
+  }
+
+  static void Deallocate(void* ptr, std::size_t size) noexcept {
+    auto index = ClassIndex(size);
+    if (index == kClassNum) {
+      return ::operator delete(ptr);
+    }
+    auto& list = Lists().classes[index];
+    if (list.size >= kMaxCachedBlocks) {
+      return ::operator delete(ptr);
+    }
+    auto block = static_cast<Block*>(ptr);
+    block->next = list.head;
+    list.head = block;
+    ++list.size;
+  }
+
+ private:
+  static constexpr std::size_t kMinBlockSize = 64;
+  static constexpr std::size_t kClassNum = 7;
+  static constexpr std::size_t kMaxCachedBlocks = 64;
+
+  struct Block {
+    Block* next;
+  };
+
+  struct FreeList {
+    Block* head = nullptr;
+    std::size_t size = 0;
+  };
+
+  struct ThreadLists {
+    FreeList classes[kClassNum];
+
+    ~ThreadLists() {
+      for (auto& list : classes) {
+        while (list.head) {
+          auto block = list.head;
+          list.head = block->next;
+          ::operator delete(block);
+        }
+      }
+    }
+  };
+
+  static std::size_t ClassIndex(std::size_t size) noexcept {
+    std::size_t index = 0;
+    auto block_size = kMinBlockSize;
+    while (block_size < size && index < kClassNum) {
+      block_size <<= 1;
+      ++index;
+    }
+    return index;
+  }
+
+  static ThreadLists& Lists() noexcept {
+    static thread_local ThreadLists lists;
+    return lists;
+  }
+};
+
+template <class T>
+class RecyclingAllocator {
+ public:
+  using value_type = T;
+
+  RecyclingAllocator() noexcept = default;
+
+  template <class U>
+  RecyclingAllocator(const RecyclingAllocator<U>&) noexcept {}
+
+  T* allocate(std::size_t n) {
+    static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__,
+                  "Over-aligned types are not supported");
+    return static_cast<T*>(RecyclingMemory::Allocate(n * sizeof(T)));
+  }
+
+  void deallocate(T* ptr, std::size_t n) noexcept {
+    RecyclingMemory::Deallocate(ptr, n * sizeof(T));
+  }
+
+  template <class U>
+  bool operator==(const RecyclingAllocator<U>&) const noexcept {
+    return true;
+  }
+
+  template <class U>
+  bool operator!=(const RecyclingAllocator<U>&) const noexcept {
+    return false;
+  }
+};
+
+// Completion handler whose associated allocator is RecyclingAllocator, asio
+// and beast allocate the operation state of the handler from it.
+template <class Handler>
+class RecyclingHandler {
+ public:
+  using allocator_type = RecyclingAllocator<void>;
+
+  explicit RecyclingHandler(Handler&& handler)
+      : handler_{std::move(handler)} {}
+
+  allocator_type get_allocator() const noexcept { return {}; }
+
+  template <class... Args>
+  void operator()(Args&&... args) {
+    handler_(std::forward<Args>(args)...);
+  }
+
+ private:
+  Handler handler_;
+};
+
+template <class Handler>
+RecyclingHandler<std::decay_t<Handler>> MakeRecyclingHandler(
+    Handler&& handler) {
+  return RecyclingHandler<std::decay_t<Handler>>{
+      std::forward<Handler>(handler)};
+}
+
+}  // namespace pirest
@@ -0,0 +1,184 @@
+#pragma once
+#include <boost/date_time.hpp>
+#include <boost/lexical_cast/try_lexical_convert.hpp>
+#include <charconv>
+#include <pirest/http_utils.hpp>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+namespace pirest {
+
+// Converts a decoded path or query argument to the type of a handler
+// parameter. Parse returns false on malformed input instead of throwing, the
+// request is then answered with 400. Specialize it to bind your own types:
+//
+//   template <>
+//   struct pirest::ArgumentParser<Point> {
+//     static bool Parse(std::string_view str, Point& value);
+//   };
+template <class T, class Enable = void>
+struct ArgumentParser {
+  static bool Parse(std::string_view str, T& value) {
+    return boost::conversion::try_lexical_convert(str.data(), str.size(),
+                                                  value);
+  }
+};
+
+template <>
+struct ArgumentParser<std::string> {
+  static bool Parse(std::string_view str, std::string& value) {
+    value.assign(str);
+    return true;
+  }
+};
+
+template <>
+struct ArgumentParser<bool> {
+  static bool Parse(std::string_view str, bool& value) noexcept {
+    if (str == "1" || IEquals(str, "true")) {
+      value = true;
+    } else if (str == "0" || IEquals(str, "false")) {
+      value = false;
+    } else {
+      return false;
+    }
+    return true;
+  }
+};
+
+template <class T>
+constexpr bool kIsCharType =
+    std::is_same_v<T, char> || std::is_same_v<T, signed char> ||
+    std::is_same_v<T, unsigned char> || std::is_same_v<T, wchar_t> ||
+    std::is_same_v<T, char8_t> || std::is_same_v<T, char16_t> ||
+    std::is_same_v<T, char32_t>;
+
+// Numbers, character types keep the lexical_cast meaning of "one char"
+template <class T>
+struct ArgumentParser<
+    T, std::enable_if_t<std::is_arithmetic_v<T> && !std::is_same_v<T, bool> &&
+                        !kIsCharType<T>>> {
+  static bool Parse(std::string_view str, T& value) noexcept {
+    if (str.size() > 1 && str[0] == '+' && str[1] != '-') {
+      str.remove_prefix(1);
+    }
+    auto end = str.data() + str.size();
+    auto [ptr, ec] = std::from_chars(str.data(), end, value);
+    return ec == std::errc{} && ptr == end;
+  }
+};
+
+// Consumes 1 to max_digits decimal digits from the front of str
+static bool ParseDigits(std::string_view& str, std::size_t max_digits,
+                        int& value) noexcept {
+  auto len = std::min(max_digits, str.size());
+  auto [ptr, ec] = std::from_chars(str.data(), str.data() + len, value);
+  if (ec != std::errc{} || ptr == str.data() || *str.data() == '-') {
+    return false;
+  }
+  str.remove_prefix(ptr - str.data());
+  return true;
+}
+
+// "2024-03-09", "2024/3/9" or "2024.03.09", consumed from the front of str
+static bool ParseDate(std::string_view& str,
+                      boost::gregorian::date& value) noexcept {
+  int year = 0;
+  int month = 0;
+  int day = 0;
+  if (!ParseDigits(str, 4, year) || str.empty()) {
+    return false;
+  }
+  auto sep = str[0];
+  if (sep != '-' && sep != '/' && sep != '.') {
+    return false;
+  }
+  str.remove_prefix(1);
+  if (!ParseDigits(str, 2, month) || str.empty() || str[0] != sep) {
+    return false;
+  }
+  str.remove_prefix(1);
+  if (!ParseDigits(str, 2, day)) {
+    return false;
+  }
+  if (year < 1400 || year > 9999 || month < 1 || month > 12 || day < 1 ||
+      day > boost::gregorian::gregorian_calendar::end_of_month_day(
+                static_cast<unsigned short>(year),
+                static_cast<unsigned short>(month))) {
+    return false;
+  }
+  value = boost::gregorian::date(static_cast<unsigned short>(year),
+                                 static_cast<unsigned short>(month),
+                                 static_cast<unsigned short>(day));
+  return true;
+}
+
+template <>
+struct ArgumentParser<boost::gregorian::date> {
+  static bool Parse(std::string_view str,
+                    boost::gregorian::date& value) noexcept {
+    return ParseDate(str, value) && str.empty();
+  }
+};
+
+// ISO 8601 extended "2024-03-09T08:30:00.250", seconds and fraction optional,
+// a date alone is midnight.
+template <>
+struct ArgumentParser<boost::posix_time::ptime> {
+  static bool Parse(std::string_view str,
+                    boost::posix_time::ptime& value) noexcept {
+    boost::gregorian::date date;
+    if (!ParseDate(str, date)) {
+      return false;
+    }
+    if (str.empty()) {
+      value = boost::posix_time::ptime{date};
+      return true;
+    }
+    int hours = 0;
+    int minutes = 0;
+    int seconds = 0;
+    if (str[0] != 'T' && str[0] != ' ') {
+      return false;
+    }
+    str.remove_prefix(1);
+    if (!ParseDigits(str, 2, hours) || str.empty() || str[0] != ':') {
+      return false;
+    }
+    str.remove_prefix(1);
+    if (!ParseDigits(str, 2, minutes)) {
+      return false;
+    }
+    if (!str.empty() && str[0] == ':') {
+      str.remove_prefix(1);
+      if (!ParseDigits(str, 2, seconds)) {
+        return false;
+      }
+    }
+    if (hours > 23 || minutes > 59 || seconds > 60) {
+      return false;
+    }
+    boost::posix_time::time_duration time{hours, minutes, seconds};
+    if (!str.empty() && (str[0] == '.' || str[0] == ',')) {
+      str.remove_prefix(1);
+      std::int64_t ticks = 0;
+      std::int64_t scale = boost::posix_time::time_duration::ticks_per_second();
+      while (!str.empty() && str[0] >= '0' && str[0] <= '9') {
+        if (scale >= 10) {
+          scale /= 10;
+          ticks += (str[0] - '0') * scale;
+        }
+        str.remove_prefix(1);
+      }
+      time += boost::posix_time::time_duration{0, 0, 0, ticks};
+    }
+    if (!str.empty()) {
+      return false;
+    }
+    value = boost::posix_time::ptime{date, time};
+    return true;
+  }
+};
+
+}  // namespace pirest
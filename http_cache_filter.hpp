@@ -0,0 +1,364 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/beast/http/serializer.hpp>
+#include <boost/container/small_vector.hpp>
+#include <chrono>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <pirest/http_connection_impl.hpp>
+#include <pirest/http_filter.hpp>
+#include <pirest/http_utils.hpp>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace pirest {
+
+// Caches serialized GET responses per method, normalized target and the
+// values of the vary headers, for the ttl of the longest matching rule. A hit
+// is sent as is without routing. Concurrent misses of a key wait for the
+// first one's response instead of running the handler again, for at most
+// lock_timeout. Must be owned by a shared_ptr, as AddFilter takes it.
+//
+// Filters added before it see every request and their OnOutgingResponse is
+// part of what it stores, filters added after it don't see hits. A response
+// whose Vary names a header outside the vary headers isn't stored, it would
+// be replayed to requests it doesn't fit, e.g. a gzip body to a client that
+// never sent Accept-Encoding. Only HTTP/1.1 keep-alive requests use the
+// cache.
+class HttpCacheFilter : public HttpFilter,
+                        public std::enable_shared_from_this<HttpCacheFilter> {
+ public:
+  const char* name() const noexcept override { return "CacheFilter"; }
+
+  Result OnIncomingRequest(const HttpConnection::Ptr& conn) override {
+    std::string key;
+    std::chrono::milliseconds ttl;
+    if (!MakeKey(conn->request(), key, ttl)) {
+      return Result::kPassed;
+    }
+    std::unique_lock<std::mutex> lock{mutex_};
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+      auto& entry = *it->second;
+      if (entry.expires > std::chrono::steady_clock::now()) {
+        entry.referenced = true;
+        auto data = entry.data;
+        lock.unlock();
+        conn->RespondSerialized(std::move(data), true);
+        return Result::kResponded;
+      }
+      Erase(it->second);
+    }
+    auto now = std::chrono::steady_clock::now();
+    auto pending = pending_.find(key);
+    if (pending == pending_.end()) {
+      auto id = ++last_pending_id_;
+      pending_.emplace(key, Pending{conn, id, now, {}});
+      ++pending_num_;
+      lock.unlock();
+      ExpireLater(conn, std::move(key), id);
+      return Result::kPassed;
+    }
+    if (now - pending->second.start < lock_timeout_) {
+      pending->second.waiters.emplace_back(conn);
+      return Result::kResponded;
+    }
+    // The first request never got its response, this one takes over
+    auto waiters = std::move(pending->second.waiters);
+    auto id = ++last_pending_id_;
+    pending->second = Pending{conn, id, now, {}};
+    lock.unlock();
+    ExpireLater(conn, std::move(key), id);
+    for (const auto& waiter : waiters) {
+      waiter->Proceed(*this);
+    }
+    return Result::kPassed;
+  }
+
+  void OnOutgingBody(const HttpConnection::Ptr& conn, HttpResponseHeader& resp,
+                     std::string* body) override {
+    if (pending_num_ == 0) {
+      return;
+    }
+    std::string key;
+    std::chrono::milliseconds ttl;
+    if (!MakeKey(conn->request(), key, ttl)) {
+      return;
+    }
+    std::unique_lock<std::mutex> lock{mutex_};
+    auto pending = pending_.find(key);
+    if (pending == pending_.end() || !IsLeader(pending->second, conn)) {
+      return;
+    }
+    auto waiters = std::move(pending->second.waiters);
+    pending_.erase(pending);
+    --pending_num_;
+    std::shared_ptr<const std::string> data;
+    if (body && IsCacheable(resp)) {
+      data = Serialize(resp, *body);
+      Insert(std::move(key), data, ttl);
+    }
+    lock.unlock();
+    for (const auto& waiter : waiters) {
+      if (data) {
+        waiter->RespondSerialized(data, true);
+      } else {
+        waiter->Proceed(*this);
+      }
+    }
+  }
+
+  // Responses of paths starting with prefix are cached for ttl
+  HttpCacheFilter& AddRule(const std::string& prefix,
+                           std::chrono::milliseconds ttl) {
+    rules_.emplace_back(prefix, ttl);
+    std::stable_sort(rules_.begin(), rules_.end(),
+                     [](const auto& lhs, const auto& rhs) {
+                       return lhs.first.size() > rhs.first.size();
+                     });
+    return *this;
+  }
+
+  HttpCacheFilter& set_vary_headers(
+      const std::vector<std::string>& vary_headers) {
+    vary_headers_ = vary_headers;
+    return *this;
+  }
+
+  // Total size of the cached responses, the least recently hit go first
+  HttpCacheFilter& set_max_bytes(std::size_t max_bytes) noexcept {
+    std::lock_guard<std::mutex> lock{mutex_};
+    max_bytes_ = max_bytes;
+    while (bytes_ > max_bytes_) {
+      Evict();
+    }
+    return *this;
+  }
+
+  // How long concurrent misses wait for the first one
+  HttpCacheFilter& set_lock_timeout(
+      std::chrono::milliseconds lock_timeout) noexcept {
+    lock_timeout_ = lock_timeout;
+    return *this;
+  }
+
+  std::size_t bytes() const noexcept {
+    std::lock_guard<std::mutex> lock{mutex_};
+    return bytes_;
+  }
+
+ private:
+  struct Entry {
+    std::string key;
+    std::shared_ptr<const std::string> data;
+    std::chrono::steady_clock::time_point expires;
+    bool referenced = false;
+  };
+
+  using EntryList = std::list<Entry>;
+
+  struct Pending {
+    // Keeps the control block, so no later connection compares equal
+    std::weak_ptr<HttpConnection> leader;
+    std::uint64_t id;
+    std::chrono::steady_clock::time_point start;
+    std::vector<HttpConnection::Ptr> waiters;
+  };
+
+  static bool IsLeader(const Pending& pending,
+                       const HttpConnection::Ptr& conn) noexcept {
+    return !pending.leader.owner_before(conn) &&
+           !conn.owner_before(pending.leader);
+  }
+
+  // The leader's response may never pass OnOutgingBody, e.g. a serialized
+  // one, a closed connection. Its waiters go on without it after
+  // lock_timeout.
+  void ExpireLater(const HttpConnection::Ptr& leader, std::string&& key,
+                   std::uint64_t id) {
+    auto timer = std::make_shared<boost::asio::steady_timer>(
+        leader->executor(), lock_timeout_);
+    timer->async_wait([timer, self = weak_from_this(), key = std::move(key),
+                       id](const boost::system::error_code&) {
+      if (auto filter = self.lock()) {
+        filter->Expire(key, id);
+      }
+    });
+  }
+
+  void Expire(const std::string& key, std::uint64_t id) {
+    std::unique_lock<std::mutex> lock{mutex_};
+    auto pending = pending_.find(key);
+    if (pending == pending_.end() || pending->second.id != id) {
+      return;
+    }
+    auto waiters = std::move(pending->second.waiters);
+    pending_.erase(pending);
+    --pending_num_;
+    lock.unlock();
+    for (const auto& waiter : waiters) {
+      waiter->Proceed(*this);
+    }
+  }
+
+  bool MakeKey(const HttpRequest& req, std::string& key,
+               std::chrono::milliseconds& ttl) const {
+    if (req.method() != boost::beast::http::verb::get || req.version() != 11 ||
+        !req.keep_alive()) {
+      return false;
+    }
+    std::string_view target = req.target();
+    auto pos = target.find('?');
+    std::string buffer;
+    auto path = DecodePath(target.substr(0, pos), buffer);
+    auto rule = std::find_if(
+        rules_.begin(), rules_.end(),
+        [path](const auto& rule) { return IStartsWith(path, rule.first); });
+    if (rule == rules_.end()) {
+      return false;
+    }
+    ttl = rule->second;
+    key.append(path);
+    if (pos != target.npos) {
+      // Same params in another order are the same target
+      boost::container::small_vector<std::string_view, 8> params;
+      auto query = target.substr(pos + 1);
+      while (!query.empty()) {
+        auto param = query.substr(0, query.find('&'));
+        query.remove_prefix(std::min(param.size() + 1, query.size()));
+        if (!param.empty()) {
+          params.emplace_back(param);
+        }
+      }
+      std::sort(params.begin(), params.end());
+      auto first = true;
+      for (auto param : params) {
+        key.push_back(first ? '?' : '&');
+        key.append(param);
+        first = false;
+      }
+    }
+    for (const auto& header : vary_headers_) {
+      key.push_back('\n');
+      key.append(req[header]);
+    }
+    return true;
+  }
+
+  bool IsCacheable(const HttpResponseHeader& resp) const {
+    if (resp.result() != boost::beast::http::status::ok ||
+        resp.find(boost::beast::http::field::set_cookie) != resp.end()) {
+      return false;
+    }
+    std::string_view cache_control =
+        resp[boost::beast::http::field::cache_control];
+    return cache_control.find("no-store") == cache_control.npos &&
+           cache_control.find("private") == cache_control.npos &&
+           AllListItems(resp[boost::beast::http::field::vary],
+                        [this](std::string_view header) {
+                          return std::any_of(
+                              vary_headers_.begin(), vary_headers_.end(),
+                              [header](const std::string& item) {
+                                return IEquals(item, header);
+                              });
+                        });
+  }
+
+  static std::shared_ptr<const std::string> Serialize(
+      const HttpResponseHeader& header, const std::string& body) {
+    HttpResponse<boost::beast::http::string_body> resp{header, body};
+    // The connection sets it only after every filter, so it is stale when a
+    // filter ahead of this one replaced the body
+    if (!resp.chunked()) {
+      resp.content_length(body.size());
+    }
+    boost::beast::http::response_serializer<boost::beast::http::string_body,
+                                            HttpFields>
+        serializer{resp};
+    auto data = std::make_shared<std::string>();
+    boost::beast::error_code ec;
+    while (!ec && !serializer.is_done()) {
+      serializer.next(ec, [&](boost::beast::error_code& ec,
+                              const auto& buffers) {
+        ec = {};
+        auto end = boost::asio::buffer_sequence_end(buffers);
+        for (auto it = boost::asio::buffer_sequence_begin(buffers); it != end;
+             ++it) {
+          boost::asio::const_buffer buffer = *it;
+          data->append(static_cast<const char*>(buffer.data()),
+                       buffer.size());
+        }
+        serializer.consume(boost::asio::buffer_size(buffers));
+      });
+    }
+    return data;
+  }
+
+  void Insert(std::string&& key, std::shared_ptr<const std::string> data,
+              std::chrono::milliseconds ttl) {
+    auto size = key.size() + data->size();
+    if (size > max_bytes_) {
+      return;
+    }
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+      Erase(it->second);
+    }
+    while (bytes_ + size > max_bytes_) {
+      Evict();
+    }
+    // Behind the hand, the last one it will look at
+    auto entry = entries_.insert(
+        hand_, Entry{std::move(key), std::move(data),
+                     std::chrono::steady_clock::now() + ttl, false});
+    index_.emplace(entry->key, entry);
+    bytes_ += size;
+  }
+
+  // CLOCK, a hit only sets referenced, the hand clears it on the way
+  void Evict() {
+    while (true) {
+      if (hand_ == entries_.end()) {
+        hand_ = entries_.begin();
+      }
+      if (!hand_->referenced) {
+        return Erase(hand_);
+      }
+      hand_->referenced = false;
+      ++hand_;
+    }
+  }
+
+  void Erase(EntryList::iterator entry) {
+    bytes_ -= entry->key.size() + entry->data->size();
+    index_.erase(entry->key);
+    if (entry == hand_) {
+      hand_ = entries_.erase(entry);
+    } else {
+      entries_.erase(entry);
+    }
+  }
+
+ private:
+  std::vector<std::pair<std::string, std::chrono::milliseconds>> rules_;
+  std::vector<std::string> vary_headers_;
+  std::chrono::milliseconds lock_timeout_ = std::chrono::seconds(10);
+  mutable std::mutex mutex_;
+  EntryList entries_;
+  EntryList::iterator hand_ = entries_.end();
+  std::unordered_map<std::string_view, EntryList::iterator, StringHash>
+      index_;
+  std::unordered_map<std::string, Pending, StringHash, std::equal_to<>>
+      pending_;
+  std::atomic<std::size_t> pending_num_ = 0;
+  std::uint64_t last_pending_id_ = 0;
+  std::size_t max_bytes_ = 64 * 1024 * 1024;
+  std::size_t bytes_ = 0;
+};
+
+}  // namespace pirest
@@ -0,0 +1,251 @@
+#pragma once
+#include <algorithm>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <pirest/http_connection_impl.hpp>
+#include <pirest/http_deflate.hpp>
+#include <pirest/http_filter.hpp>
+#include <pirest/http_utils.hpp>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace pirest {
+
+// Compresses the chunks of a chunked response.
+class HttpDeflateBodyEncoder : public HttpBodyEncoder {
+ public:
+  HttpDeflateBodyEncoder(HttpDeflateFormat format, int level)
+      : encoder_{format, level} {}
+
+  void Encode(boost::asio::const_buffer data, bool last,
+              std::string& out) override {
+    encoder_.Encode(data, last, out);
+  }
+
+ private:
+  HttpDeflateEncoder encoder_;
+};
+
+// Compresses string and chunked response bodies with gzip or deflate, as
+// Accept-Encoding asks. String bodies below min_size are left alone. The
+// compressed bodies of responses with an ETag are kept up to cache_bytes,
+// so a static payload is compressed once per coding.
+//
+// File bodies are left to sendfile. Added before HttpCacheFilter, the cache
+// stores compressed responses and needs Accept-Encoding as a vary header.
+class HttpCompressFilter : public HttpFilter {
+ public:
+  using Format = HttpDeflateFormat;
+
+  const char* name() const noexcept override { return "CompressFilter"; }
+
+  Result OnIncomingRequest(const HttpConnection::Ptr& /*conn*/) override {
+    return Result::kPassed;
+  }
+
+  void OnOutgingBody(const HttpConnection::Ptr& conn, HttpResponseHeader& resp,
+                     std::string* body) override {
+    if (!body || body->size() < min_size_ || !IsCompressible(resp)) {
+      return;
+    }
+    AddVary(resp, "Accept-Encoding");
+    auto format = Negotiate(conn->request());
+    if (!format) {
+      return;
+    }
+    std::string key;
+    auto etag = resp[boost::beast::http::field::etag];
+    if (!etag.empty() && cache_bytes_ > 0) {
+      key.append(conn->request().target()).push_back('\n');
+      key.append(etag).push_back(*format == Format::kGzip ? 'g' : 'd');
+      if (auto data = Find(key)) {
+        *body = *data;
+        SetEncoding(resp, *format);
+        return;
+      }
+    }
+    thread_local std::optional<HttpDeflateEncoder> encoder;
+    if (encoder) {
+      encoder->Reset(*format, level_);
+    } else {
+      encoder.emplace(*format, level_);
+    }
+    std::string out;
+    out.reserve(body->size() / 4);
+    encoder->Encode(boost::asio::buffer(*body), true, out);
+    if (out.size() >= body->size()) {
+      return;
+    }
+    *body = std::move(out);
+    SetEncoding(resp, *format);
+    if (!key.empty()) {
+      Insert(std::move(key), *body);
+    }
+  }
+
+  std::unique_ptr<HttpBodyEncoder> OnOutgingChunked(
+      const HttpConnection::Ptr& conn, HttpResponseHeader& resp) override {
+    if (!IsCompressible(resp)) {
+      return nullptr;
+    }
+    AddVary(resp, "Accept-Encoding");
+    auto format = Negotiate(conn->request());
+    if (!format) {
+      return nullptr;
+    }
+    SetEncoding(resp, *format);
+    return std::make_unique<HttpDeflateBodyEncoder>(*format, level_);
+  }
+
+  // Content types that compress, by prefix
+  HttpCompressFilter& set_content_types(
+      const std::vector<std::string>& content_types) {
+    content_types_ = content_types;
+    return *this;
+  }
+
+  HttpCompressFilter& set_min_size(std::size_t min_size) noexcept {
+    min_size_ = min_size;
+    return *this;
+  }
+
+  // 1 is the fastest, 9 the smallest
+  HttpCompressFilter& set_level(int level) noexcept {
+    level_ = std::clamp(level, 1, 9);
+    return *this;
+  }
+
+  HttpCompressFilter& set_cache_bytes(std::size_t cache_bytes) noexcept {
+    std::lock_guard<std::mutex> lock{mutex_};
+    cache_bytes_ = cache_bytes;
+    Shrink();
+    return *this;
+  }
+
+ private:
+  using EntryList =
+      std::list<std::pair<std::string, std::shared_ptr<const std::string>>>;
+
+  bool IsCompressible(const HttpResponseHeader& resp) const {
+    if (resp.result() == boost::beast::http::status::partial_content ||
+        resp.find(boost::beast::http::field::content_encoding) != resp.end()) {
+      return false;
+    }
+    std::string_view cache_control =
+        resp[boost::beast::http::field::cache_control];
+    if (cache_control.find("no-transform") != cache_control.npos) {
+      return false;
+    }
+    std::string_view content_type =
+        resp[boost::beast::http::field::content_type];
+    return std::any_of(content_types_.begin(), content_types_.end(),
+                       [content_type](const auto& prefix) {
+                         return IStartsWith(content_type, prefix);
+                       });
+  }
+
+  // The coding the client takes, gzip first
+  static std::optional<Format> Negotiate(const HttpRequest& req) {
+    std::string_view accept = req[boost::beast::http::field::accept_encoding];
+    bool gzip = false;
+    bool deflate = false;
+    while (!accept.empty()) {
+      auto item = accept.substr(0, accept.find(','));
+      accept.remove_prefix(std::min(item.size() + 1, accept.size()));
+      auto semicolon = item.find(';');
+      auto coding = Trim(item.substr(0, semicolon));
+      if (semicolon != item.npos) {
+        // q=0, q=0.0 and so on refuse the coding
+        auto params = item.substr(semicolon + 1);
+        auto q = params.find("q=");
+        if (q != params.npos &&
+            Trim(params.substr(q + 2)).find_first_not_of("0.") ==
+                std::string_view::npos) {
+          continue;
+        }
+      }
+      if (IEquals(coding, "gzip") || IEquals(coding, "x-gzip") ||
+          coding == "*") {
+        gzip = true;
+      } else if (IEquals(coding, "deflate")) {
+        deflate = true;
+      }
+    }
+    if (gzip) {
+      return Format::kGzip;
+    }
+    if (deflate) {
+      return Format::kDeflate;
+    }
+    return std::nullopt;
+  }
+
+  // The encoded body is another representation, so a strong ETag turns weak
+  static void SetEncoding(HttpResponseHeader& resp, Format format) {
+    resp.set(boost::beast::http::field::content_encoding,
+             format == Format::kGzip ? "gzip" : "deflate");
+    std::string_view etag = resp[boost::beast::http::field::etag];
+    if (!etag.empty() && !etag.starts_with("W/")) {
+      resp.set(boost::beast::http::field::etag, "W/" + std::string{etag});
+    }
+  }
+
+  static std::string_view Trim(std::string_view str) noexcept {
+    auto begin = str.find_first_not_of(" \t");
+    if (begin == str.npos) {
+      return {};
+    }
+    return str.substr(begin, str.find_last_not_of(" \t") - begin + 1);
+  }
+
+  std::shared_ptr<const std::string> Find(const std::string& key) {
+    std::lock_guard<std::mutex> lock{mutex_};
+    auto it = index_.find(key);
+    if (it == index_.end()) {
+      return nullptr;
+    }
+    // Most recently used first
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return it->second->second;
+  }
+
+  void Insert(std::string&& key, const std::string& data) {
+    auto size = key.size() + data.size();
+    std::lock_guard<std::mutex> lock{mutex_};
+    if (size > cache_bytes_ || index_.count(key) > 0) {
+      return;
+    }
+    entries_.emplace_front(std::move(key),
+                           std::make_shared<const std::string>(data));
+    index_.emplace(entries_.front().first, entries_.begin());
+    bytes_ += size;
+    Shrink();
+  }
+
+  void Shrink() {
+    while (bytes_ > cache_bytes_) {
+      auto& entry = entries_.back();
+      bytes_ -= entry.first.size() + entry.second->size();
+      index_.erase(entry.first);
+      entries_.pop_back();
+    }
+  }
+
+ private:
+  std::vector<std::string> content_types_{
+      "text/", "application/json", "application/javascript",
+      "application/xml", "image/svg+xml"};
+  std::size_t min_size_ = 1024;
+  int level_ = 6;
+  std::mutex mutex_;
+  EntryList entries_;
+  std::unordered_map<std::string_view, EntryList::iterator, StringHash>
+      index_;
+  std::size_t cache_bytes_ = 16 * 1024 * 1024;
+  std::size_t bytes_ = 0;
+};
+
+}  // namespace pirest
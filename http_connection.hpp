@@ -1,19 +1,46 @@
 #pragma once
 #include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/ip/address.hpp>
+#include <boost/beast/core/error.hpp>
 #include <boost/beast/http/empty_body.hpp>
 #include <boost/beast/http/message.hpp>
 #include <boost/beast/http/status.hpp>
 #include <boost/beast/http/string_body.hpp>
+#include <pirest/http_allocator.hpp>
+#include <string_view>
 #include <variant>
 
 namespace pirest {
 
 using HttpBodyType = boost::beast::http::string_body;
 
-using HttpRequest = boost::beast::http::request<HttpBodyType>;
+// Header fields of requests and responses live in recycled memory, so a warm
+// keep-alive connection doesn't touch the global heap for them.
+using HttpFields = boost::beast::http::basic_fields<RecyclingAllocator<char>>;
+
+using HttpRequest = boost::beast::http::request<HttpBodyType, HttpFields>;
+
+template <class Body>
+using HttpResponse = boost::beast::http::response<Body, HttpFields>;
+
+using HttpResponseHeader = boost::beast::http::response_header<HttpFields>;
 
 using HttpHeaderList = std::vector<std::pair<std::string, std::string>>;
 
+// Transforms the body of a chunked response on its way out, one chunk at a
+// time, on the io thread of the connection.
+class HttpBodyEncoder {
+ public:
+  virtual ~HttpBodyEncoder() noexcept {}
+
+  // Appends the encoded data to out, last flushes whatever is held back.
+  virtual void Encode(boost::asio::const_buffer data, bool last,
+                      std::string& out) = 0;
+};
+
+class HttpFilter;
 class HttpPlainConnection;
 class HttpSslConnection;
 template <class>
@@ -34,8 +61,28 @@ class HttpConnection {
         conn_variant_);
   }
 
-  template <class Body>
-  void Respond(boost::beast::http::response<Body>&& resp) {
+  // Routes added with HandleStream only. Reads the request body into buffer
+  // until it is full or the body ends, then calls on the io thread
+  // handler(const boost::beast::error_code& ec, std::size_t size, bool done).
+  // The next chunk is read only when asked for. Responding before done closes
+  // the connection after the response. Takes any completion token, in a
+  // coroutine handler co_await ReadBody(buffer, boost::asio::use_awaitable).
+  template <class CompletionToken>
+  auto ReadBody(boost::asio::mutable_buffer buffer, CompletionToken&& token) {
+    return boost::asio::async_initiate<
+        CompletionToken, void(boost::beast::error_code, std::size_t, bool)>(
+        [this](auto handler, boost::asio::mutable_buffer buffer) {
+          std::visit(
+              [&](const auto& conn) {
+                conn->ReadBody(buffer, std::move(handler));
+              },
+              conn_variant_);
+        },
+        token, buffer);
+  }
+
+  template <class Body, class Fields>
+  void Respond(boost::beast::http::response<Body, Fields>&& resp) {
     std::visit([&resp](const auto& conn) { conn->Respond(std::move(resp)); },
                conn_variant_);
   }
@@ -47,8 +94,8 @@ class HttpConnection {
 
   void Respond(boost::beast::http::status status, bool keep_alive,
                const HttpHeaderList& headers = {}) {
-    boost::beast::http::response<boost::beast::http::empty_body> resp{
-        status, request_.version()};
+    HttpResponse<boost::beast::http::empty_body> resp{status,
+                                                      request_.version()};
     resp.content_length(0);
     resp.keep_alive(keep_alive);
     for (const auto& pair : headers) {
@@ -66,8 +113,8 @@ class HttpConnection {
   void Respond(boost::beast::http::status status, std::string&& body,
                const char* content_type, bool keep_alive,
                const HttpHeaderList& headers = {}) {
-    boost::beast::http::response<boost::beast::http::string_body> resp{
-        status, request_.version()};
+    HttpResponse<boost::beast::http::string_body> resp{status,
+                                                       request_.version()};
     resp.keep_alive(keep_alive);
     resp.set(boost::beast::http::field::content_type, content_type);
     for (const auto& pair : headers) {
@@ -86,8 +133,8 @@ class HttpConnection {
   void Respond(boost::beast::http::status status, const std::string& body,
                const char* content_type, bool keep_alive,
                const HttpHeaderList& headers = {}) {
-    boost::beast::http::response<boost::beast::http::string_body> resp{
-        status, request_.version()};
+    HttpResponse<boost::beast::http::string_body> resp{status,
+                                                       request_.version()};
     resp.keep_alive(keep_alive);
     resp.set(boost::beast::http::field::content_type, content_type);
     for (const auto& pair : headers) {
@@ -98,15 +145,94 @@ class HttpConnection {
     Respond(std::move(resp));
   }
 
-  void set_allow_origin(const std::string& origin) noexcept {
-    allow_origin_ = origin;
+  // Sends header with Transfer-Encoding: chunked right away, the body follows
+  // with WriteChunk and ends with FinishChunks. HTTP/1.0 clients get the body
+  // as is and the connection closes after it.
+  void RespondChunked(HttpResponseHeader&& header) {
+    std::visit(
+        [&header](const auto& conn) -> void {
+          conn->RespondChunked(std::move(header));
+        },
+        conn_variant_);
+  }
+
+  void RespondChunked(boost::beast::http::status status,
+                      const char* content_type,
+                      const HttpHeaderList& headers = {}) {
+    HttpResponse<boost::beast::http::empty_body> resp{status,
+                                                      request_.version()};
+    resp.keep_alive(request_.keep_alive());
+    resp.set(boost::beast::http::field::content_type, content_type);
+    for (const auto& pair : headers) {
+      resp.set(pair.first, pair.second);
+    }
+    RespondChunked(std::move(resp.base()));
+  }
+
+  // Sends data as one chunk, then calls on the io thread
+  // handler(const boost::beast::error_code& ec) once it is written. data must
+  // stay valid until then, and the next chunk must wait for the handler.
+  // Takes any completion token, like ReadBody.
+  template <class CompletionToken>
+  auto WriteChunk(boost::asio::const_buffer data, CompletionToken&& token) {
+    return boost::asio::async_initiate<CompletionToken,
+                                       void(boost::beast::error_code)>(
+        [this](auto handler, boost::asio::const_buffer data) {
+          std::visit(
+              [&](const auto& conn) {
+                conn->WriteChunk(data, std::move(handler));
+              },
+              conn_variant_);
+        },
+        token, data);
+  }
+
+  // Sends the last chunk, handler is called as for WriteChunk.
+  template <class CompletionToken>
+  auto FinishChunks(CompletionToken&& token) {
+    return boost::asio::async_initiate<CompletionToken,
+                                       void(boost::beast::error_code)>(
+        [this](auto handler) {
+          std::visit(
+              [&](const auto& conn) { conn->FinishChunks(std::move(handler)); },
+              conn_variant_);
+        },
+        token);
+  }
+
+  // Sends a response serialized beforehand as is, the filters don't see it.
+  void RespondSerialized(std::shared_ptr<const std::string> data,
+                         bool keep_alive) {
+    std::visit(
+        [&](const auto& conn) -> void {
+          conn->RespondSerialized(std::move(data), keep_alive);
+        },
+        conn_variant_);
+  }
+
+  // Continues a request that filter held back with Result::kResponded, with
+  // the filters after it and then the route.
+  void Proceed(const HttpFilter& filter) {
+    std::visit([&filter](const auto& conn) -> void { conn->Proceed(filter); },
+               conn_variant_);
+  }
+
+  // Reuses the storage of the previous request's origin
+  void set_allow_origin(std::string_view origin) {
+    allow_origin_.assign(origin.data(), origin.size());
   }
 
   const std::string& allow_origin() const noexcept { return allow_origin_; }
 
+  // Of the peer, looked up once when the connection is accepted
+  const boost::asio::ip::address& remote_address() const noexcept {
+    return remote_address_;
+  }
+
  protected:
   HttpRequest request_;
   std::string allow_origin_;
+  boost::asio::ip::address remote_address_;
   std::variant<HttpConnectionBase<HttpPlainConnection>*,
                HttpConnectionBase<HttpSslConnection>*>
       conn_variant_;
@@ -1,21 +1,344 @@
 #pragma once
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/bind_executor.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/dispatch.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/write.hpp>
 #include <boost/beast/core/detect_ssl.hpp>
 #include <boost/beast/core/flat_buffer.hpp>
 #include <boost/beast/core/tcp_stream.hpp>
+#include <boost/beast/http/buffer_body.hpp>
 #include <boost/beast/http/parser.hpp>
 #include <boost/beast/http/read.hpp>
+#include <boost/beast/http/serializer.hpp>
 #include <boost/beast/http/write.hpp>
 #include <boost/beast/ssl/ssl_stream.hpp>
+#include <boost/circular_buffer.hpp>
+#include <pirest/http_admission.hpp>
 #include <pirest/http_connection.hpp>
+#include <pirest/http_decoding_body.hpp>
+#include <pirest/http_file_body.hpp>
 #include <pirest/http_filter.hpp>
 #include <pirest/http_router.hpp>
 #include <pirest/http_setting.hpp>
+#include <pirest/http_trace.hpp>
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <optional>
+#include <span>
+#include <type_traits>
+#include <vector>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <cerrno>
+#endif
 
 namespace pirest {
 
-using HttpParser = boost::beast::http::request_parser<HttpBodyType>;
+// The body becomes the HttpBodyType of the request once it is read.
+using HttpParser =
+    boost::beast::http::request_parser<HttpDecodingBody,
+                                       RecyclingAllocator<char>>;
 
+using HttpBodyParser =
+    boost::beast::http::request_parser<boost::beast::http::buffer_body,
+                                       RecyclingAllocator<char>>;
+
+using HttpWriteBuffers = std::vector<boost::asio::const_buffer>;
+
+// A response waiting in the write queue of a connection.
+class HttpQueuedResponse {
+ public:
+  using Ptr = std::shared_ptr<HttpQueuedResponse>;
+
+  virtual ~HttpQueuedResponse() noexcept {}
+
+  // Appends the next buffers to send, Consume must follow once they're sent.
+  virtual void Next(boost::beast::error_code& ec,
+                    HttpWriteBuffers& buffers) = 0;
+
+  virtual void Consume() = 0;
+
+  virtual bool is_done() noexcept = 0;
+
+  // Whether the first Next yields the whole message, so the responses queued
+  // behind it can share the same write.
+  virtual bool is_single_shot() const noexcept = 0;
+
+  virtual bool keep_alive() const noexcept = 0;
+
+  // The connection failed before the response was sent.
+  virtual void Fail(const boost::beast::error_code& /*ec*/) {}
+
+  // The rest of the body when it can go straight from a file, else null.
+  virtual HttpFileSlice* file_body() noexcept { return nullptr; }
+
+  HttpRequestTrace& trace() noexcept { return trace_; }
+
+ private:
+  [[no_unique_address]] HttpRequestTrace trace_;
+};
+
+template <class Body>
+class HttpBasicQueuedResponse : public HttpQueuedResponse {
+ public:
+  explicit HttpBasicQueuedResponse(HttpResponse<Body>&& resp)
+      : resp_{std::move(resp)}, serializer_{resp_} {}
+
+  void Next(boost::beast::error_code& ec, HttpWriteBuffers& buffers) override {
+    serializer_.next(ec, [this, &buffers](boost::beast::error_code& ec,
+                                          const auto& next_buffers) {
+      ec = {};
+      auto end = boost::asio::buffer_sequence_end(next_buffers);
+      for (auto it = boost::asio::buffer_sequence_begin(next_buffers);
+           it != end; ++it) {
+        boost::asio::const_buffer buffer = *it;
+        buffers.emplace_back(buffer);
+        prepared_ += buffer.size();
+      }
+    });
+  }
+
+  void Consume() override {
+    serializer_.consume(prepared_);
+    prepared_ = 0;
+  }
+
+  bool is_done() noexcept override { return serializer_.is_done(); }
+
+  bool is_single_shot() const noexcept override {
+    return std::is_same_v<Body, boost::beast::http::empty_body> ||
+           std::is_same_v<Body, boost::beast::http::string_body>;
+  }
+
+  bool keep_alive() const noexcept override { return resp_.keep_alive(); }
+
+ private:
+  HttpResponse<Body> resp_;
+  boost::beast::http::serializer<false, Body, HttpFields> serializer_;
+  std::size_t prepared_ = 0;
+};
+
+// A response serialized beforehand, shared with other connections.
+class HttpSerializedResponse : public HttpQueuedResponse {
+ public:
+  HttpSerializedResponse(std::shared_ptr<const std::string> data,
+                         bool keep_alive) noexcept
+      : data_{std::move(data)}, keep_alive_{keep_alive} {}
+
+  void Next(boost::beast::error_code& ec, HttpWriteBuffers& buffers) override {
+    ec = {};
+    buffers.emplace_back(boost::asio::buffer(*data_));
+  }
+
+  void Consume() override { done_ = true; }
+
+  bool is_done() noexcept override { return done_; }
+
+  bool is_single_shot() const noexcept override { return true; }
+
+  bool keep_alive() const noexcept override { return keep_alive_; }
+
+ private:
+  std::shared_ptr<const std::string> data_;
+  bool keep_alive_;
+  bool done_ = false;
+};
+
+// A file response. Once the header is out, a connection that can sendfile
+// takes the body from file_body() instead of reading it through Next.
+class HttpFileResponse : public HttpQueuedResponse {
+ public:
+  explicit HttpFileResponse(HttpResponse<HttpFileBody>&& resp)
+      : resp_{std::move(resp)}, serializer_{resp_} {
+    serializer_.split(true);
+  }
+
+  HttpFileSlice* file_body() noexcept override {
+    if (!serializer_.is_header_done() || reading_ ||
+        resp_.body().file().remaining() == 0) {
+      return nullptr;
+    }
+    return &resp_.body().file();
+  }
+
+  void Next(boost::beast::error_code& ec, HttpWriteBuffers& buffers) override {
+    reading_ = serializer_.is_header_done();
+    serializer_.next(ec, [this, &buffers](boost::beast::error_code& ec,
+                                          const auto& next_buffers) {
+      ec = {};
+      auto end = boost::asio::buffer_sequence_end(next_buffers);
+      for (auto it = boost::asio::buffer_sequence_begin(next_buffers);
+           it != end; ++it) {
+        boost::asio::const_buffer buffer = *it;
+        buffers.emplace_back(buffer);
+        prepared_ += buffer.size();
+      }
+    });
+  }
+
+  void Consume() override {
+    // Nothing was prepared when the body went by sendfile
+    if (prepared_ > 0) {
+      serializer_.consume(prepared_);
+      prepared_ = 0;
+    }
+  }
+
+  bool is_done() noexcept override {
+    return serializer_.is_done() ||
+           (serializer_.is_header_done() && !reading_ &&
+            resp_.body().file().remaining() == 0);
+  }
+
+  bool is_single_shot() const noexcept override { return false; }
+
+  bool keep_alive() const noexcept override { return resp_.keep_alive(); }
+
+ private:
+  HttpResponse<HttpFileBody> resp_;
+  boost::beast::http::response_serializer<HttpFileBody, HttpFields>
+      serializer_;
+  std::size_t prepared_ = 0;
+  bool reading_ = false;
+};
+
+// Completion of HttpConnection::WriteChunk and FinishChunks.
+class HttpChunkHandler {
+ public:
+  using Ptr = std::shared_ptr<HttpChunkHandler>;
+
+  virtual ~HttpChunkHandler() noexcept {}
+
+  virtual void Complete(const boost::beast::error_code& ec) = 0;
+};
+
+template <class Handler>
+class HttpBasicChunkHandler : public HttpChunkHandler {
+ public:
+  explicit HttpBasicChunkHandler(Handler&& handler)
+      : handler_{std::move(handler)} {}
+
+  void Complete(const boost::beast::error_code& ec) override {
+    std::move(handler_)(ec);
+  }
+
+ private:
+  Handler handler_;
+};
+
+// A response whose body the handler supplies one chunk at a time. The header
+// goes out on its own, Next reports need_buffer while no chunk is pending.
+class HttpChunkedResponse : public HttpQueuedResponse {
+ public:
+  using Ptr = std::shared_ptr<HttpChunkedResponse>;
+
+  HttpChunkedResponse(
+      HttpResponse<boost::beast::http::buffer_body>&& resp,
+      std::vector<std::unique_ptr<HttpBodyEncoder>>&& encoders,
+      boost::asio::any_io_executor executor)
+      : resp_{std::move(resp)},
+        serializer_{resp_},
+        encoders_{std::move(encoders)},
+        executor_{std::move(executor)} {
+    resp_.body().data = nullptr;
+    resp_.body().more = true;
+    serializer_.split(true);
+  }
+
+  bool is_pending() const noexcept { return static_cast<bool>(pending_); }
+
+  const boost::beast::error_code& error() const noexcept { return ec_; }
+
+  // Runs data through the encoders, the result stays valid until the next
+  // call and may be empty when they hold data back.
+  boost::asio::const_buffer Encode(boost::asio::const_buffer data,
+                                   bool last) {
+    for (std::size_t i = 0; i < encoders_.size(); ++i) {
+      auto& out = encoded_[i % 2];
+      out.clear();
+      encoders_[i]->Encode(data, last, out);
+      data = boost::asio::buffer(out);
+    }
+    return data;
+  }
+
+  // data stays in use until handler completes, the last chunk may be empty.
+  void SetChunk(boost::asio::const_buffer data, bool last,
+                HttpChunkHandler::Ptr&& handler) {
+    auto& body = resp_.body();
+    body.data = data.size() > 0 ? const_cast<void*>(data.data()) : nullptr;
+    body.size = data.size();
+    body.more = !last;
+    pending_ = std::move(handler);
+  }
+
+  void Next(boost::beast::error_code& ec, HttpWriteBuffers& buffers) override {
+    // With split, the buffers are body ones once the header is out
+    sending_chunk_ = serializer_.is_header_done();
+    serializer_.next(ec, [this, &buffers](boost::beast::error_code& ec,
+                                          const auto& next_buffers) {
+      ec = {};
+      auto end = boost::asio::buffer_sequence_end(next_buffers);
+      for (auto it = boost::asio::buffer_sequence_begin(next_buffers);
+           it != end; ++it) {
+        boost::asio::const_buffer buffer = *it;
+        buffers.emplace_back(buffer);
+        prepared_ += buffer.size();
+      }
+    });
+  }
+
+  void Consume() override {
+    serializer_.consume(prepared_);
+    prepared_ = 0;
+    if (sending_chunk_ && pending_) {
+      Complete({});
+    }
+  }
+
+  bool is_done() noexcept override { return serializer_.is_done(); }
+
+  bool is_single_shot() const noexcept override { return false; }
+
+  bool keep_alive() const noexcept override { return resp_.keep_alive(); }
+
+  void Fail(const boost::beast::error_code& ec) override {
+    ec_ = ec;
+    if (pending_) {
+      Complete(ec);
+    }
+  }
+
+ private:
+  // Posted, the handler may write the next chunk right away
+  void Complete(const boost::beast::error_code& ec) {
+    boost::asio::post(executor_, MakeRecyclingHandler(
+                                     [handler = std::move(pending_), ec]() {
+                                       handler->Complete(ec);
+                                     }));
+  }
+
+  HttpResponse<boost::beast::http::buffer_body> resp_;
+  boost::beast::http::response_serializer<boost::beast::http::buffer_body,
+                                          HttpFields>
+      serializer_;
+  std::vector<std::unique_ptr<HttpBodyEncoder>> encoders_;
+  std::string encoded_[2];
+  boost::asio::any_io_executor executor_;
+  HttpChunkHandler::Ptr pending_;
+  boost::beast::error_code ec_;
+  std::size_t prepared_ = 0;
+  bool sending_chunk_ = false;
+};
+
+// Requests are handled one at a time, but reading the next request only
+// waits for the handler to respond, not for the response to be sent. Queued
+// responses go out in request order, several per write when possible.
 template <class D>
 class HttpConnectionBase : public HttpConnection {
   using DerivedPtr = std::shared_ptr<D>;
@@ -23,8 +346,29 @@ class HttpConnectionBase : public HttpConnection {
  public:
   HttpConnectionBase(boost::beast::flat_buffer buffer, HttpRouter& router,
                      HttpSetting& setting) noexcept
-      : buffer_{std::move(buffer)}, router_{router}, setting_{setting} {
+      : buffer_{std::move(buffer)},
+        router_{router},
+        setting_{setting},
+        write_queue_{std::max<std::size_t>(setting.pipeline_depth, 1)},
+        metrics_{setting.metrics},
+        admission_{setting.admission} {
     conn_variant_ = this;
+    if (metrics_) {
+      metrics_->OnConnect();
+    }
+    if (admission_) {
+      admission_->OnConnect();
+    }
+  }
+
+  ~HttpConnectionBase() noexcept {
+    if (metrics_) {
+      metrics_->OnDisconnect();
+    }
+    if (admission_) {
+      ReleaseRequest();
+      admission_->OnDisconnect();
+    }
   }
 
   boost::asio::any_io_executor executor() noexcept {
@@ -34,89 +378,597 @@ class HttpConnectionBase : public HttpConnection {
   void ReadRequest() { ReadRequest(Derived().shared_from_this()); }
 
   void ReadRequest(DerivedPtr&& self) {
+    reading_ = true;
+    trace_.Start(setting_.tracer, HttpTracePhase::kReadHeader);
+    body_parser_.reset();
     parser_.emplace();
     parser_->header_limit(setting_.header_limit);
+    // The header comes first, so that the route decides how to read the body
+    // and whether body_limit applies.
+    parser_->body_limit(boost::none);
+    boost::beast::http::async_read_header(
+        Derived().stream(), buffer_, *parser_,
+        MakeRecyclingHandler([self = std::move(self)](
+                                 const boost::beast::error_code& ec,
+                                 std::size_t bytes_transferred) mutable {
+          self->OnHeader(self, ec, bytes_transferred);
+        }));
+  }
+
+  void OnHeader(DerivedPtr& self, const boost::beast::error_code& ec,
+                std::size_t bytes_transferred) {
+    if (ec) {
+      return OnRequest(self, ec, bytes_transferred);
+    }
+    // Before the shortcut below, a stream route reads even an empty body
+    if (router_.IsStreamBody(parser_->get().target())) {
+      reading_ = false;
+      Derived().ExpiresNever();
+      body_parser_.emplace(std::move(*parser_));
+      body_parser_->body_limit(boost::none);
+      request_ = HttpRequest{std::move(body_parser_->get().base())};
+      return HandleRequest(self);
+    }
+    if (parser_->is_done()) {
+      return OnRequest(self, ec, bytes_transferred);
+    }
+    auto& req = parser_->get();
+    auto coding = req[boost::beast::http::field::content_encoding];
+    if (!HttpDecodingBody::IsSupported(coding)) {
+      reading_ = false;
+      Derived().ExpiresNever();
+      request_ = HttpRequest{std::move(req.base())};
+      handling_ = true;
+      StartRequest();
+      HttpConnection::Ptr conn = self;
+      return conn->Respond(boost::beast::http::status::unsupported_media_type,
+                           false, {{"Accept-Encoding", "gzip, deflate"}});
+    }
+    // Inflated bodies are held to the limits as they grow
+    req.body().coding = HttpDecodingBody::Format(coding);
+    req.body().limit = setting_.body_limit.value_or(
+        std::numeric_limits<std::uint64_t>::max());
+    req.body().max_ratio = setting_.inflate_ratio_limit;
     if (setting_.body_limit) {
+      auto length = parser_->content_length();
+      if (length && *length > *setting_.body_limit) {
+        return OnRequest(self, boost::beast::http::error::body_limit,
+                         bytes_transferred);
+      }
       parser_->body_limit(*setting_.body_limit);
-    } else {
-      parser_->body_limit(boost::none);
     }
+    trace_.Begin(HttpTracePhase::kReadBody);
     boost::beast::http::async_read(
         Derived().stream(), buffer_, *parser_,
-        [self = std::move(self)](const boost::beast::error_code& ec,
+        MakeRecyclingHandler([self = std::move(self)](
+                                 const boost::beast::error_code& ec,
                                  std::size_t bytes_transferred) {
           self->OnRequest(self, ec, bytes_transferred);
-        });
+        }));
   }
 
   void OnRequest(const HttpConnection::Ptr& conn,
                  const boost::beast::error_code& ec,
                  std::size_t bytes_transferred) {
     boost::ignore_unused(bytes_transferred);
+    reading_ = false;
     if (ec) {
-      if (ec == boost::beast::http::error::end_of_stream) {
+      closing_ = true;
+      if (ec == boost::beast::http::error::end_of_stream && !writing_ &&
+          write_queue_.empty()) {
         Derived().DoEof();
       }
     } else {
       Derived().ExpiresNever();
-      request_ = parser_->release();
-      for (const auto& filter : setting_.filters) {
-        if (filter->OnIncomingRequest(conn) == HttpFilter::Result::kResponded) {
-          return;
+      auto req = parser_->release();
+      auto decoded = req.body().decoded;
+      request_ = HttpRequest{std::move(req.base()), std::move(req.body().data)};
+      if (decoded) {
+        request_.erase(boost::beast::http::field::content_encoding);
+        request_.content_length(request_.body().size());
+      }
+      HandleRequest(conn);
+    }
+  }
+
+  void HandleRequest(const HttpConnection::Ptr& conn,
+                     std::size_t first_filter = 0) {
+    handling_ = true;
+    if (first_filter == 0) {
+      StartRequest();
+      if (admission_) {
+        if (!admission_->AdmitRequest()) {
+          return RespondSerialized(HttpAdmission::ServiceUnavailable(),
+                                   request_.keep_alive());
         }
+        admitted_ = true;
+      }
+      trace_.Begin(HttpTracePhase::kFilters);
+    }
+    const auto& filters = setting_.filters;
+    for (auto i = first_filter; i < filters.size(); ++i) {
+      if (filters[i]->OnIncomingRequest(conn) ==
+          HttpFilter::Result::kResponded) {
+        return;
+      }
+    }
+    trace_.Begin(HttpTracePhase::kHandler);
+    if (auto pool = router_.FindWorkerPool(request_.target())) {
+      // Nothing else touches the connection until the handler responds
+      if (!pool->TryPost([this, conn]() { Route(conn); })) {
+        conn->Respond(boost::beast::http::status::service_unavailable,
+                      "Service unavailable", "text/plain");
       }
-      try {
-        router_.Routing(conn, request_.method_string(), request_.target());
-      } catch (const std::exception& e) {
-        return conn->Respond(boost::beast::http::status::bad_request, e.what(),
-                             "text/plain", false);
+      return;
+    }
+    Route(conn);
+  }
+
+  template <class Handler>
+  void ReadBody(boost::asio::mutable_buffer buffer, Handler&& handler) {
+    boost::asio::dispatch(
+        executor(),
+        MakeRecyclingHandler(
+            [self = Derived().shared_from_this(), buffer,
+             handler = std::forward<Handler>(handler)]() mutable {
+              self->DoReadBody(buffer, std::move(handler));
+            }));
+  }
+
+  template <class Body, class Fields>
+  void Respond(boost::beast::http::response<Body, Fields>&& resp) {
+    if constexpr (std::is_same_v<Fields, HttpFields>) {
+      DoRespond(std::move(resp));
+    } else {
+      HttpResponse<Body> converted{resp.result(), resp.version()};
+      for (const auto& field : resp) {
+        converted.insert(field.name_string(), field.value());
       }
+      converted.body() = std::move(resp.body());
+      DoRespond(std::move(converted));
     }
   }
 
+  void RespondSerialized(std::shared_ptr<const std::string> data,
+                         bool keep_alive) {
+    if (metrics_) {
+      // "HTTP/1.1 200 OK"
+      unsigned status = 0;
+      for (std::size_t i = 9; i < 12 && i < data->size(); ++i) {
+        status = status * 10 + static_cast<unsigned>((*data)[i] - '0');
+      }
+      RecordResponse(status);
+    }
+    HttpQueuedResponse::Ptr item = std::allocate_shared<HttpSerializedResponse>(
+        RecyclingAllocator<HttpSerializedResponse>{}, std::move(data),
+        keep_alive);
+    boost::asio::dispatch(
+        executor(), MakeRecyclingHandler([self = Derived().shared_from_this(),
+                                          item = std::move(item)]() mutable {
+          self->Enqueue(std::move(item));
+        }));
+  }
+
+  void Proceed(const HttpFilter& filter) {
+    boost::asio::dispatch(
+        executor(), MakeRecyclingHandler([self = Derived().shared_from_this(),
+                                          &filter]() {
+          const auto& filters = self->setting_.filters;
+          auto it = std::find_if(filters.begin(), filters.end(),
+                                 [&filter](const auto& item) {
+                                   return item.get() == &filter;
+                                 });
+          auto next = it == filters.end() ? filters.size()
+                                          : it - filters.begin() + 1;
+          self->HandleRequest(self, static_cast<std::size_t>(next));
+        }));
+  }
+
+  void RespondChunked(HttpResponseHeader&& header) {
+    HttpResponse<boost::beast::http::buffer_body> resp{std::move(header)};
+    if (resp.version() >= 11) {
+      resp.chunked(true);
+    } else {
+      // The body ends with the connection
+      resp.keep_alive(false);
+    }
+    if (metrics_) {
+      RecordResponse(resp.result_int());
+    }
+    auto self = Derived().shared_from_this();
+    for (const auto& filter : setting_.filters) {
+      filter->OnOutgingResponse(self, resp);
+    }
+    for (const auto& filter : setting_.filters) {
+      filter->OnOutgingBody(self, resp, nullptr);
+    }
+    std::vector<std::unique_ptr<HttpBodyEncoder>> encoders;
+    for (const auto& filter : setting_.filters) {
+      if (auto encoder = filter->OnOutgingChunked(self, resp)) {
+        encoders.emplace_back(std::move(encoder));
+      }
+    }
+    auto item = std::allocate_shared<HttpChunkedResponse>(
+        RecyclingAllocator<HttpChunkedResponse>{}, std::move(resp),
+        std::move(encoders), executor());
+    boost::asio::dispatch(
+        executor(), MakeRecyclingHandler([self = std::move(self),
+                                          item = std::move(item)]() mutable {
+          self->chunked_ = item;
+          self->Enqueue(std::move(item));
+        }));
+  }
+
+  template <class Handler>
+  void WriteChunk(boost::asio::const_buffer data, Handler&& handler) {
+    boost::asio::dispatch(
+        executor(),
+        MakeRecyclingHandler(
+            [self = Derived().shared_from_this(), data,
+             handler = std::forward<Handler>(handler)]() mutable {
+              self->DoWriteChunk(data, false, std::move(handler));
+            }));
+  }
+
+  template <class Handler>
+  void FinishChunks(Handler&& handler) {
+    boost::asio::dispatch(
+        executor(), MakeRecyclingHandler(
+                        [self = Derived().shared_from_this(),
+                         handler = std::forward<Handler>(handler)]() mutable {
+                          self->DoWriteChunk({}, true, std::move(handler));
+                        }));
+  }
+
+ private:
+  D& Derived() noexcept { return reinterpret_cast<D&>(*this); }
+
+  void Route(const HttpConnection::Ptr& conn) {
+    RouteError error = RouteError::kNone;
+    try {
+      router_.Routing(conn, request_.method_string(), request_.target(),
+                      error, metrics_ ? &route_ : nullptr);
+    } catch (const std::exception& e) {
+      return conn->Respond(boost::beast::http::status::bad_request, e.what(),
+                           "text/plain", false);
+    } catch (...) {
+      return conn->Respond(boost::beast::http::status::internal_server_error,
+                           "Internal server error", "text/plain", false);
+    }
+    if (error != RouteError::kNone) {
+      return conn->Respond(boost::beast::http::status::bad_request,
+                           RouteErrorMessage(error), "text/plain", false);
+    }
+  }
+
+  void StartRequest() noexcept {
+    if (metrics_) {
+      route_ = nullptr;
+      request_start_ = std::chrono::steady_clock::now();
+    }
+  }
+
+  // The latency runs from the parsed request to the queued response. The
+  // next request isn't read before that, so route_ is still this request's.
+  void RecordResponse(unsigned status) noexcept {
+    auto& metrics = route_ ? route_->metrics() : metrics_->unrouted();
+    metrics.Record(status, std::chrono::steady_clock::now() - request_start_);
+  }
+
   template <class Body>
-  void Respond(boost::beast::http::response<Body>&& resp) {
+  void DoRespond(HttpResponse<Body>&& resp) {
     if (!resp.has_content_length() && !resp.chunked()) {
       resp.content_length(0);
     }
+    if (metrics_) {
+      RecordResponse(resp.result_int());
+    }
     auto self = Derived().shared_from_this();
     for (const auto& filter : setting_.filters) {
       filter->OnOutgingResponse(self, resp);
     }
-    auto ptr =
-        std::make_unique<boost::beast::http::response<Body>>(std::move(resp));
-    auto p = ptr.get();
-    boost::beast::http::async_write(
-        Derived().stream(), *p,
-        [self = std::move(self), ptr = std::move(ptr),
-         close = !p->keep_alive()](const boost::beast::error_code& ec,
-                                   std::size_t bytes_transferred) mutable {
-          ptr.reset();
-          self->OnWrite(self, close, ec, bytes_transferred);
+    if constexpr (std::is_same_v<Body, boost::beast::http::string_body>) {
+      auto size = resp.body().size();
+      for (const auto& filter : setting_.filters) {
+        filter->OnOutgingBody(self, resp, &resp.body());
+      }
+      if (resp.body().size() != size && !resp.chunked()) {
+        resp.content_length(resp.body().size());
+      }
+    } else {
+      for (const auto& filter : setting_.filters) {
+        filter->OnOutgingBody(self, resp, nullptr);
+      }
+    }
+    // The queued response, the handlers and the write operation all come
+    // from recycled memory.
+    HttpQueuedResponse::Ptr item;
+    if constexpr (std::is_same_v<Body, HttpFileBody>) {
+      item = std::allocate_shared<HttpFileResponse>(
+          RecyclingAllocator<HttpFileResponse>{}, std::move(resp));
+    } else {
+      item = std::allocate_shared<HttpBasicQueuedResponse<Body>>(
+          RecyclingAllocator<HttpBasicQueuedResponse<Body>>{},
+          std::move(resp));
+    }
+    // Handlers may respond from other threads, the queue belongs to the
+    // io thread of the connection.
+    boost::asio::dispatch(
+        executor(), MakeRecyclingHandler([self = std::move(self),
+                                          item = std::move(item)]() mutable {
+          self->Enqueue(std::move(item));
+        }));
+  }
+
+  template <class Handler>
+  void DoReadBody(boost::asio::mutable_buffer buffer, Handler&& handler) {
+    if (!body_parser_ || body_parser_->is_done()) {
+      boost::beast::error_code ec;
+      if (!body_parser_) {
+        ec = boost::asio::error::operation_not_supported;
+      }
+      return boost::asio::post(
+          executor(), MakeRecyclingHandler(
+                          [handler = std::move(handler), ec]() mutable {
+                            std::move(handler)(ec, 0, true);
+                          }));
+    }
+    auto& body = body_parser_->get().body();
+    body.data = buffer.data();
+    body.size = buffer.size();
+    Derived().ExpiresAfter(setting_.read_timeout);
+    boost::beast::http::async_read(
+        Derived().stream(), buffer_, *body_parser_,
+        MakeRecyclingHandler(
+            [self = Derived().shared_from_this(), size = buffer.size(),
+             handler = std::move(handler)](boost::beast::error_code ec,
+                                           std::size_t) mutable {
+              self->Derived().ExpiresNever();
+              if (ec == boost::beast::http::error::need_buffer) {
+                ec = {};
+              }
+              std::move(handler)(
+                  ec, size - self->body_parser_->get().body().size,
+                  self->body_parser_->is_done());
+            }));
+  }
+
+  template <class Handler>
+  void DoWriteChunk(boost::asio::const_buffer data, bool last,
+                    Handler&& handler) {
+    boost::beast::error_code ec;
+    if (!chunked_) {
+      ec = boost::asio::error::operation_not_supported;
+    } else if (chunked_->error()) {
+      ec = chunked_->error();
+    } else if (chunked_->is_pending()) {
+      ec = boost::asio::error::in_progress;
+    } else if (data.size() > 0 || last) {
+      data = chunked_->Encode(data, last);
+    }
+    // An empty chunk would read as the last one, so it isn't sent
+    if (!ec && (data.size() > 0 || last)) {
+      using ChunkHandler = HttpBasicChunkHandler<std::decay_t<Handler>>;
+      chunked_->SetChunk(data, last,
+                         std::allocate_shared<ChunkHandler>(
+                             RecyclingAllocator<ChunkHandler>{},
+                             std::move(handler)));
+      if (last) {
+        // The next request may be handled while the last chunk is sent
+        chunked_.reset();
+        handling_ = false;
+      }
+      Write();
+      if (last) {
+        ReadNext();
+      }
+      return;
+    }
+    boost::asio::post(executor(),
+                      MakeRecyclingHandler(
+                          [handler = std::move(handler), ec]() mutable {
+                            std::move(handler)(ec);
+                          }));
+  }
+
+  void Enqueue(HttpQueuedResponse::Ptr&& item) {
+    ReleaseRequest();
+    if (!item->keep_alive() || (body_parser_ && !body_parser_->is_done())) {
+      closing_ = true;
+    }
+    if (write_queue_.full()) {
+      write_queue_.set_capacity(write_queue_.capacity() + 1);
+    }
+    trace_.Begin(HttpTracePhase::kWrite);
+    item->trace() = std::move(trace_);
+    write_queue_.push_back(std::move(item));
+    // Still handling while the handler feeds a chunked response
+    handling_ = static_cast<bool>(chunked_);
+    // Writes started before the read timeout is armed run without a timer,
+    // as they did before pipelining.
+    Write();
+    ReadNext();
+  }
+
+  void ReleaseRequest() noexcept {
+    if (admitted_) {
+      admitted_ = false;
+      admission_->OnRequestDone();
+    }
+  }
+
+  void ReadNext() {
+    if (!closing_ && !handling_ && !reading_ &&
+        write_queue_.size() < setting_.pipeline_depth) {
+      Derived().ExpiresAfter(setting_.read_timeout);
+      ReadRequest();
+    }
+  }
+
+  void Write() {
+    if (writing_ || write_queue_.empty()) {
+      return;
+    }
+    if constexpr (D::kSendFile) {
+      if (auto file = write_queue_.front()->file_body()) {
+        writing_ = true;
+        write_batch_ = 1;
+        return SendFile(*file, 0);
+      }
+    }
+    write_buffers_.clear();
+    write_batch_ = 0;
+    for (const auto& item : write_queue_) {
+      boost::beast::error_code ec;
+      item->Next(ec, write_buffers_);
+      if (ec) {
+        if (write_batch_ == 0) {
+          return;
+        }
+        break;
+      }
+      ++write_batch_;
+      if (!item->is_single_shot() || !item->keep_alive()) {
+        break;
+      }
+    }
+    writing_ = true;
+    // A span, asio would copy a vector into the operation.
+    boost::asio::async_write(
+        Derived().stream(),
+        std::span<const boost::asio::const_buffer>{write_buffers_},
+        MakeRecyclingHandler([self = Derived().shared_from_this()](
+                                 const boost::beast::error_code& ec,
+                                 std::size_t bytes_transferred) {
+          self->OnWrite(ec, bytes_transferred);
+        }));
+  }
+
+  // Sends the file from the page cache until the socket would block, then
+  // waits for it to be writable. Completes like a write of one response.
+  // The wait bypasses the expiry of the stream, so a timer of its own closes
+  // the socket once the client has read nothing for read_timeout.
+  void SendFile(HttpFileSlice& file, std::size_t sent) {
+#ifdef __linux__
+    auto& socket = Derived().stream().socket();
+    boost::beast::error_code ec;
+    socket.native_non_blocking(true, ec);
+    while (!ec && file.remaining() > 0) {
+      auto offset = static_cast<off_t>(file.file_offset());
+      auto n = ::sendfile(socket.native_handle(), file.native_handle(), &offset,
+                          static_cast<std::size_t>(std::min<std::uint64_t>(
+                              file.remaining(), kMaxSendFile)));
+      if (n > 0) {
+        file.Advance(static_cast<std::uint64_t>(n));
+        sent += static_cast<std::size_t>(n);
+      } else if (n == 0) {
+        // The file shrank since its size was sent
+        ec = boost::asio::error::eof;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        ExpireSendFile();
+        return socket.async_wait(
+            boost::asio::socket_base::wait_write,
+            MakeRecyclingHandler([self = Derived().shared_from_this(), &file,
+                                  sent](boost::beast::error_code ec) {
+              if (ec && self->SendFileExpired()) {
+                ec = boost::beast::error::timeout;
+              }
+              self->send_file_timer_->cancel();
+              if (ec) {
+                return self->OnWrite(ec, sent);
+              }
+              self->SendFile(file, sent);
+            }));
+      } else if (errno != EINTR) {
+        ec.assign(errno, boost::system::system_category());
+      }
+    }
+    OnWrite(ec, sent);
+#else
+    boost::ignore_unused(file, sent);
+#endif
+  }
+
+  void ExpireSendFile() {
+    if (!send_file_timer_) {
+      send_file_timer_.emplace(Derived().stream().get_executor());
+    }
+    send_file_timer_->expires_after(setting_.read_timeout);
+    send_file_timer_->async_wait(
+        [self = Derived().shared_from_this()](
+            const boost::beast::error_code& ec) {
+          // A stale wait of a timer armed again since finds it in the future
+          if (!ec && self->SendFileExpired()) {
+            boost::beast::error_code ignored;
+            self->Derived().stream().socket().close(ignored);
+          }
         });
   }
 
-  void OnWrite(DerivedPtr& self, bool close, const boost::beast::error_code& ec,
+  bool SendFileExpired() const noexcept {
+    return send_file_timer_->expiry() <= std::chrono::steady_clock::now();
+  }
+
+  void OnWrite(const boost::beast::error_code& ec,
                std::size_t bytes_transferred) {
-    boost::ignore_unused(bytes_transferred);
-    if (!ec) {
-      if (close) {
-        Derived().DoEof();
-      } else {
-        Derived().ExpiresAfter(setting_.read_timeout);
-        ReadRequest(std::move(self));
+    writing_ = false;
+    if (metrics_) {
+      metrics_->OnWrite(bytes_transferred);
+    }
+    if (ec) {
+      for (const auto& item : write_queue_) {
+        item->Fail(ec);
       }
+      return;
+    }
+    for (std::size_t i = 0; i < write_batch_; ++i) {
+      auto& item = write_queue_.front();
+      item->Consume();
+      if (!item->is_done()) {
+        break;
+      }
+      item->trace().End();
+      if (!item->keep_alive()) {
+        return Derived().DoEof();
+      }
+      write_queue_.pop_front();
+    }
+    if (closing_ && !reading_ && !handling_ && write_queue_.empty()) {
+      return Derived().DoEof();
     }
+    Write();
+    ReadNext();
   }
 
- private:
-  D& Derived() noexcept { return reinterpret_cast<D&>(*this); }
-
  protected:
+  void SetRemoteAddress(const boost::asio::ip::tcp::socket& socket) noexcept {
+    boost::system::error_code ec;
+    remote_address_ = socket.remote_endpoint(ec).address();
+  }
+
   std::optional<HttpParser> parser_;
+  std::optional<HttpBodyParser> body_parser_;
+  HttpChunkedResponse::Ptr chunked_;
   boost::beast::flat_buffer buffer_;
   HttpRouter& router_;
   HttpSetting& setting_;
+  boost::circular_buffer<HttpQueuedResponse::Ptr> write_queue_;
+  HttpWriteBuffers write_buffers_;
+  std::size_t write_batch_ = 0;
+  // Below the 0x7ffff000 bytes a single sendfile moves at most
+  static constexpr std::uint64_t kMaxSendFile = 1 << 30;
+  std::optional<boost::asio::steady_timer> send_file_timer_;
+  bool reading_ = false;
+  bool handling_ = false;
+  bool writing_ = false;
+  bool closing_ = false;
+  // The request counts against admission_
+  bool admitted_ = false;
+  std::shared_ptr<HttpMetrics> metrics_;
+  std::shared_ptr<HttpAdmission> admission_;
+  HttpRouter::RouteItem* route_ = nullptr;
+  std::chrono::steady_clock::time_point request_start_;
+  [[no_unique_address]] HttpRequestTrace trace_;
 };
 
 class HttpPlainConnection
@@ -128,7 +980,15 @@ class HttpPlainConnection
                       boost::asio::ssl::context&, HttpRouter& router,
                       HttpSetting& setting) noexcept
       : HttpConnectionBase{std::move(buffer), router, setting},
-        stream_{std::move(stream)} {}
+        stream_{std::move(stream)} {
+    SetRemoteAddress(stream_.socket());
+  }
+
+#ifdef __linux__
+  static constexpr bool kSendFile = true;
+#else
+  static constexpr bool kSendFile = false;
+#endif
 
   void Run() { ReadRequest(); }
 
@@ -158,18 +1018,31 @@ class HttpSslConnection
                     boost::asio::ssl::context& ssl_ctx, HttpRouter& router,
                     HttpSetting& setting) noexcept
       : HttpConnectionBase{std::move(buffer), router, setting},
-        stream_{std::move(stream), ssl_ctx} {}
+        stream_{std::move(stream), ssl_ctx} {
+    SetRemoteAddress(stream_.next_layer().socket());
+  }
+
+  static constexpr bool kSendFile = false;
 
   void Run() {
-    stream_.async_handshake(
-        boost::asio::ssl::stream_base::server, buffer_.data(),
-        [this, self = shared_from_this()](const boost::beast::error_code& ec,
-                                          std::size_t bytes_used) mutable {
-          if (!ec) {
-            buffer_.consume(bytes_used);
-            ReadRequest(std::move(self));
-          }
-        });
+    // TLS 1.3 sends its tickets in a write of their own, the response
+    // behind them mustn't wait for their ack
+    boost::beast::error_code ec;
+    stream_.next_layer().socket().set_option(
+        boost::asio::ip::tcp::no_delay{true}, ec);
+    HttpRequestTrace trace;
+    trace.Start(setting_.tracer, HttpTracePhase::kHandshake);
+    if (!setting_.handshake_context) {
+      return Handshake(shared_from_this(), std::move(trace),
+                       stream_.get_executor());
+    }
+    // The socket stays with the io thread, the steps of the handshake
+    // complete on the handshake thread
+    auto ctx = setting_.handshake_context();
+    boost::asio::post(*ctx, [this, self = shared_from_this(),
+                             trace = std::move(trace), ctx]() mutable {
+      Handshake(std::move(self), std::move(trace), ctx->get_executor());
+    });
   }
 
   boost::beast::ssl_stream<boost::beast::tcp_stream>& stream() noexcept {
@@ -183,10 +1056,34 @@ class HttpSslConnection
   void ExpiresNever() { stream_.next_layer().expires_never(); }
 
   void DoEof() {
-    stream_.async_shutdown([](const boost::beast::error_code& ec) {});
+    // The close_notify must outlive the last handler holding the connection
+    stream_.async_shutdown(
+        [self = shared_from_this()](const boost::beast::error_code&) {});
   }
 
  private:
+  template <class Executor>
+  void Handshake(std::shared_ptr<HttpSslConnection> self,
+                 HttpRequestTrace trace, const Executor& executor) {
+    stream_.async_handshake(
+        boost::asio::ssl::stream_base::server, buffer_.data(),
+        boost::asio::bind_executor(
+            executor,
+            [this, self = std::move(self), trace = std::move(trace)](
+                const boost::beast::error_code& ec,
+                std::size_t bytes_used) mutable {
+              trace.End();
+              if (ec) {
+                return;
+              }
+              buffer_.consume(bytes_used);
+              boost::asio::dispatch(stream_.get_executor(),
+                                    [this, self = std::move(self)]() mutable {
+                                      ReadRequest(std::move(self));
+                                    });
+            }));
+  }
+
   boost::beast::ssl_stream<boost::beast::tcp_stream> stream_;
 };
 
@@ -233,4 +1130,31 @@ class HttpDetectConnection
   HttpSetting& setting_;
 };
 
+#ifdef BOOST_ASIO_HAS_CO_AWAIT
+// Starts the coroutine of a handler on the io thread of conn, owner lives
+// until it finishes. An exception escaping it is answered like one thrown by
+// a plain handler.
+inline void SpawnRouteHandler(const HttpConnection::Ptr& conn,
+                              boost::asio::awaitable<void> handler,
+                              std::shared_ptr<void> owner) {
+  boost::asio::co_spawn(
+      conn->executor(), std::move(handler),
+      [conn, owner = std::move(owner)](std::exception_ptr e) {
+        if (!e) {
+          return;
+        }
+        try {
+          std::rethrow_exception(e);
+        } catch (const std::exception& ex) {
+          conn->Respond(boost::beast::http::status::bad_request, ex.what(),
+                        "text/plain", false);
+        } catch (...) {
+          // Rethrown, it would end the io thread of every connection on it
+          conn->Respond(boost::beast::http::status::internal_server_error,
+                        "Internal server error", "text/plain", false);
+        }
+      });
+}
+#endif
+
 }  // namespace pirest
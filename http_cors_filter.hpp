@@ -1,18 +1,34 @@
 #pragma once
-#include <boost/algorithm/string.hpp>
+#include <algorithm>
 #include <boost/beast/core/string_type.hpp>
+#include <memory>
+#include <pirest/http_connection_impl.hpp>
 #include <pirest/http_filter.hpp>
 #include <pirest/http_utils.hpp>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
 namespace pirest {
 
+// Origins and request headers are looked up in case-insensitive hash tables
+// without copying them. Each allowed origin has its preflight response
+// serialized beforehand, sent as is to HTTP/1.1 keep-alive requests whose
+// origin is spelled the canonical way. Like any serialized response it skips
+// the OnOutgingResponse of every other filter. Other preflights are built per
+// request. Actual responses only get the headers that apply to them, and
+// vary on Origin unless any origin is allowed.
 class HttpCorsFilter : public HttpFilter {
  public:
+  HttpCorsFilter() { Rebuild(); }
+
   const char* name() const noexcept override { return "CorsFilter"; }
 
   Result OnIncomingRequest(const HttpConnection::Ptr& conn) override {
-    conn->set_allow_origin("");
+    conn->set_allow_origin({});
     auto& req = conn->request();
     if (req.method() == boost::beast::http::verb::options) {
       return HandleOptions(conn);
@@ -21,30 +37,24 @@ class HttpCorsFilter : public HttpFilter {
     if (it == req.end()) {
       return Result::kPassed;
     }
-    auto allowed_origin = VerifyOrigin(it->value());
-    if (allowed_origin.empty()) {
+    auto origin = View(it->value());
+    if (!allow_any_origins_ && !FindOrigin(origin)) {
       conn->Respond(boost::beast::http::status::forbidden, "Origin not allowed",
                     "text/plain", false);
       return Result::kResponded;
     }
-    conn->set_allow_origin(allowed_origin);
+    conn->set_allow_origin(allow_any_origins_ ? "*" : origin);
     return Result::kPassed;
   }
 
   void OnOutgingResponse(const HttpConnection::Ptr& conn,
-                         boost::beast::http::response_header<>& resp) override {
+                         HttpResponseHeader& resp) override {
+    if (!allow_any_origins_) {
+      AddVary(resp, "Origin");
+    }
     if (conn->allow_origin().size() > 0) {
       resp.set(boost::beast::http::field::access_control_allow_origin,
                conn->allow_origin());
-      if (allow_any_headers_) {
-        resp.set(boost::beast::http::field::access_control_allow_headers, "*");
-      } else if (allow_headers_string_.size() > 0) {
-        resp.set(boost::beast::http::field::access_control_allow_headers,
-                 allow_headers_string_);
-      }
-      resp.set(boost::beast::http::field::access_control_allow_methods,
-               allow_methods_string_);
-      resp.set(boost::beast::http::field::access_control_max_age, max_age_);
       if (expose_headers_string_.size() > 0) {
         resp.set(boost::beast::http::field::access_control_expose_headers,
                  expose_headers_string_);
@@ -54,32 +64,30 @@ class HttpCorsFilter : public HttpFilter {
 
   HttpCorsFilter& set_allow_origins(
       const std::vector<std::string>& allow_origins) noexcept {
-    allow_origins_ = allow_origins;
-    for (auto& origin : allow_origins_) {
-      auto pos = origin.find(":80");
-      if (pos == std::string::npos) {
-        pos = origin.find(":443");
-      }
-      if (pos != std::string::npos) {
-        origin = origin.substr(0, pos);
-      }
+    allow_origins_.clear();
+    for (const auto& item : allow_origins) {
+      std::string origin{StripDefaultPort(item)};
       ToLower(origin);
+      allow_origins_.emplace(std::move(origin), nullptr);
     }
+    Rebuild();
     return *this;
   }
 
   HttpCorsFilter& set_allow_headers(
       const std::vector<std::string>& allow_headers) noexcept {
-    allow_headers_ = allow_headers;
+    allow_headers_.clear();
     allow_headers_string_ = "";
-    for (auto& header : allow_headers_) {
+    for (auto header : allow_headers) {
       ToLower(header);
       allow_headers_string_.append(header);
       allow_headers_string_.append(",");
+      allow_headers_.emplace(std::move(header));
     }
     if (allow_headers_string_.size() > 0) {
       allow_headers_string_.pop_back();
     }
+    Rebuild();
     return *this;
   }
 
@@ -95,6 +103,7 @@ class HttpCorsFilter : public HttpFilter {
     if (allow_methods_string_.size() > 0) {
       allow_methods_string_.pop_back();
     }
+    Rebuild();
     return *this;
   }
 
@@ -109,11 +118,13 @@ class HttpCorsFilter : public HttpFilter {
     if (expose_headers_string_.size() > 0) {
       expose_headers_string_.pop_back();
     }
+    Rebuild();
     return *this;
   }
 
   HttpCorsFilter& set_max_age(std::int32_t max_age) noexcept {
     max_age_ = std::to_string(max_age);
+    Rebuild();
     return *this;
   }
 
@@ -124,119 +135,163 @@ class HttpCorsFilter : public HttpFilter {
 
   HttpCorsFilter& set_allow_any_origins(bool allow_any_origins) noexcept {
     allow_any_origins_ = allow_any_origins;
+    Rebuild();
     return *this;
   }
 
   HttpCorsFilter& set_allow_any_headers(bool allow_any_headers) noexcept {
     allow_any_headers_ = allow_any_headers;
+    Rebuild();
     return *this;
   }
 
  private:
+  using OriginMap =
+      std::unordered_map<std::string, std::shared_ptr<const std::string>,
+                         IHash, IEqual>;
+
+  static std::string_view View(boost::beast::string_view str) noexcept {
+    return {str.data(), str.size()};
+  }
+
+  // Only the default port of the scheme, "http://host:443" is another origin
+  static std::string_view StripDefaultPort(std::string_view origin) noexcept {
+    static const std::pair<std::string_view, std::string_view> kDefaults[] = {
+        {"http://", ":80"}, {"https://", ":443"}};
+    for (const auto& [scheme, port] : kDefaults) {
+      if (IStartsWith(origin, scheme) && origin.ends_with(port) &&
+          origin.size() > scheme.size() + port.size()) {
+        return origin.substr(0, origin.size() - port.size());
+      }
+    }
+    return origin;
+  }
+
+  const OriginMap::value_type* FindOrigin(
+      std::string_view origin) const noexcept {
+    auto it = allow_origins_.find(StripDefaultPort(origin));
+    return it == allow_origins_.end() ? nullptr : &*it;
+  }
+
+  bool AllowMethod(std::string_view method) const noexcept {
+    return std::any_of(
+        allow_methods_.begin(), allow_methods_.end(),
+        [method](const std::string& item) { return IEquals(item, method); });
+  }
+
+  // headers is the comma separated Access-Control-Request-Headers
+  bool AllowHeaders(std::string_view headers) const noexcept {
+    return allow_any_headers_ ||
+           AllListItems(headers, [this](std::string_view header) {
+             return allow_headers_.find(header) != allow_headers_.end();
+           });
+  }
+
   Result HandleOptions(const HttpConnection::Ptr& conn) const {
+    static const auto options = std::make_shared<const std::string>(
+        "HTTP/1.1 200 OK\r\n"
+        "Allow: *\r\n"
+        "Age: 3600\r\n"
+        "Content-Length: 0\r\n"
+        "\r\n");
     auto& req = conn->request();
-    boost::beast::http::response<boost::beast::http::empty_body> resp;
+    bool canned = req.version() == 11 && req.keep_alive();
+    HttpResponse<boost::beast::http::empty_body> resp;
     resp.version(req.version());
-    auto origin = req[boost::beast::http::field::origin];
-    if (origin.size() > 0) {
-      auto request_method =
-          req[boost::beast::http::field::access_control_request_method];
-      if (request_method.empty()) {
-        resp.result(boost::beast::http::status::bad_request);
-      } else {
-        auto request_headers =
-            req[boost::beast::http::field::access_control_request_headers];
-        auto allowed_origin =
-            Preflight(origin, request_method, request_headers);
-        if (allowed_origin.size() > 0) {
-          conn->set_allow_origin(allowed_origin);
-          resp.result(boost::beast::http::status::ok);
-        } else {
-          resp.result(boost::beast::http::status::forbidden);
-        }
+    auto origin = View(req[boost::beast::http::field::origin]);
+    if (origin.empty()) {
+      if (canned) {
+        conn->RespondSerialized(options, true);
+        return Result::kResponded;
       }
-    } else {
       resp.result(boost::beast::http::status::ok);
       resp.set(boost::beast::http::field::allow, "*");
       resp.set(boost::beast::http::field::age, "3600");
+      conn->Respond(std::move(resp));
+      return Result::kResponded;
+    }
+    auto request_method =
+        View(req[boost::beast::http::field::access_control_request_method]);
+    if (request_method.empty()) {
+      resp.result(boost::beast::http::status::bad_request);
+      conn->Respond(std::move(resp));
+      return Result::kResponded;
+    }
+    auto allowed = allow_any_origins_ ? nullptr : FindOrigin(origin);
+    if ((!allow_any_origins_ && !allowed) || !AllowMethod(request_method) ||
+        !AllowHeaders(View(
+            req[boost::beast::http::field::access_control_request_headers]))) {
+      resp.result(boost::beast::http::status::forbidden);
+      conn->Respond(std::move(resp));
+      return Result::kResponded;
+    }
+    if (canned && allow_any_origins_) {
+      conn->RespondSerialized(any_origin_preflight_, true);
+      return Result::kResponded;
+    }
+    if (canned && allowed->first == origin) {
+      conn->RespondSerialized(allowed->second, true);
+      return Result::kResponded;
     }
+    conn->set_allow_origin(allow_any_origins_ ? "*" : origin);
+    resp.result(boost::beast::http::status::ok);
+    if (allow_any_headers_) {
+      resp.set(boost::beast::http::field::access_control_allow_headers, "*");
+    } else if (allow_headers_string_.size() > 0) {
+      resp.set(boost::beast::http::field::access_control_allow_headers,
+               allow_headers_string_);
+    }
+    resp.set(boost::beast::http::field::access_control_allow_methods,
+             allow_methods_string_);
+    resp.set(boost::beast::http::field::access_control_max_age, max_age_);
     conn->Respond(std::move(resp));
     return Result::kResponded;
   }
 
-  std::string VerifyOrigin(boost::beast::string_view origin) const {
-    std::string allowed_origin;
-    if (allow_any_origins_) {
-      allowed_origin = "*";
-    } else {
-      auto pos = origin.find(":80");
-      if (pos == std::string::npos) {
-        pos = origin.find(":443");
-      }
-      if (pos != std::string::npos) {
-        allowed_origin = origin.substr(0, pos);
-      } else {
-        allowed_origin = origin;
-      }
-      ToLower(allowed_origin);
-      auto it = std::find_if(allow_origins_.begin(), allow_origins_.end(),
-                             [&allowed_origin](const std::string& item) {
-                               return item == allowed_origin;
-                             });
-      if (it == allow_origins_.end()) {
-        allowed_origin = "";
-      } else {
-        allowed_origin = origin;
-      }
+  std::shared_ptr<const std::string> SerializePreflight(
+      std::string_view origin) const {
+    std::string out = "HTTP/1.1 200 OK\r\nAccess-Control-Allow-Origin: ";
+    out.append(origin);
+    out.append("\r\n");
+    if (allow_any_headers_) {
+      out.append("Access-Control-Allow-Headers: *\r\n");
+    } else if (allow_headers_string_.size() > 0) {
+      out.append("Access-Control-Allow-Headers: ");
+      out.append(allow_headers_string_);
+      out.append("\r\n");
     }
-    return allowed_origin;
-  }
-
-  std::string Preflight(boost::beast::string_view origin,
-                        boost::beast::string_view request_method,
-                        boost::beast::string_view request_headers) const {
-    auto allowed_origin = VerifyOrigin(origin);
-    if (allowed_origin.empty()) {
-      return "";
-    }
-    {
-      std::string req_method = request_method;
-      ToUpper(req_method);
-      auto it = std::find_if(allow_methods_.begin(), allow_methods_.end(),
-                             [&req_method](const std::string& method) {
-                               return method == req_method;
-                             });
-      if (it == allow_methods_.end()) {
-        return "";
-      }
+    out.append("Access-Control-Allow-Methods: ");
+    out.append(allow_methods_string_);
+    out.append("\r\nAccess-Control-Max-Age: ");
+    out.append(max_age_);
+    out.append("\r\n");
+    if (expose_headers_string_.size() > 0) {
+      out.append("Access-Control-Expose-Headers: ");
+      out.append(expose_headers_string_);
+      out.append("\r\n");
     }
-    if (!allow_any_headers_ && request_headers.size() > 0) {
-      std::string req_headers = request_headers;
-      TrimAllSpace(req_headers);
-      ToLower(req_headers);
-      std::vector<std::string> vec;
-      boost::split(vec, req_headers, boost::is_any_of(","));
-      for (const auto& header : vec) {
-        auto it = std::find_if(
-            allow_headers_.begin(), allow_headers_.end(),
-            [&header](const std::string& item) { return item == header; });
-        if (it == allow_headers_.end()) {
-          return "";
-        }
-      }
+    out.append("Content-Length: 0\r\n\r\n");
+    return std::make_shared<const std::string>(std::move(out));
+  }
+
+  void Rebuild() {
+    for (auto& [origin, preflight] : allow_origins_) {
+      preflight = SerializePreflight(origin);
     }
-    return allowed_origin;
+    any_origin_preflight_ = SerializePreflight("*");
   }
 
  private:
-  std::vector<std::string> allow_origins_;
-  std::vector<std::string> allow_headers_;
+  // Lowercase without the default port, to the preflight each gets
+  OriginMap allow_origins_;
+  std::unordered_set<std::string, IHash, IEqual> allow_headers_;
   std::string allow_headers_string_;
   std::vector<std::string> allow_methods_;
   std::string allow_methods_string_;
   std::vector<std::string> expose_headers_;
   std::string expose_headers_string_;
   std::string max_age_ = "3600";
+  std::shared_ptr<const std::string> any_origin_preflight_;
   bool allow_credentials_ = false;
   bool allow_any_origins_ = false;
   bool allow_any_headers_ = false;
@@ -0,0 +1,122 @@
+#pragma once
+#include <boost/beast/http/error.hpp>
+#include <boost/beast/http/message.hpp>
+#include <boost/optional.hpp>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <pirest/http_deflate.hpp>
+#include <pirest/http_utils.hpp>
+#include <string>
+
+namespace pirest {
+
+// A string body which inflates coding while it is parsed, set from the
+// Content-Encoding of the header before the body is read. The inflated size is
+// bounded by limit, and by max_ratio times the encoded size once that is past
+// a few KB.
+struct HttpDecodingBody {
+  struct value_type {
+    std::string data;
+    std::optional<HttpDeflateFormat> coding;
+    std::uint64_t limit = std::numeric_limits<std::uint64_t>::max();
+    std::uint32_t max_ratio = 0;
+    bool decoded = false;
+  };
+
+  static std::uint64_t size(const value_type& body) noexcept {
+    return body.data.size();
+  }
+
+  // The codings the reader inflates, identity aside
+  static bool IsSupported(std::string_view coding) noexcept {
+    return coding.empty() || IEquals(coding, "identity") ||
+           Format(coding).has_value();
+  }
+
+  static std::optional<HttpDeflateFormat> Format(
+      std::string_view coding) noexcept {
+    if (IEquals(coding, "gzip") || IEquals(coding, "x-gzip")) {
+      return HttpDeflateFormat::kGzip;
+    }
+    if (IEquals(coding, "deflate")) {
+      return HttpDeflateFormat::kDeflate;
+    }
+    return std::nullopt;
+  }
+
+  class reader {
+   public:
+    template <bool isRequest, class Fields>
+    reader(boost::beast::http::header<isRequest, Fields>&, value_type& body)
+        : body_{body} {}
+
+    void init(const boost::optional<std::uint64_t>& length,
+              boost::beast::error_code& ec) {
+      ec = {};
+      body_.data.clear();
+      body_.decoded = false;
+      if (body_.coding) {
+        decoder_.emplace(*body_.coding);
+      }
+      if (length && !decoder_) {
+        if (*length > body_.data.max_size()) {
+          ec = boost::beast::http::error::buffer_overflow;
+          return;
+        }
+        body_.data.reserve(static_cast<std::size_t>(*length));
+      }
+    }
+
+    template <class ConstBufferSequence>
+    std::size_t put(const ConstBufferSequence& buffers,
+                    boost::beast::error_code& ec) {
+      ec = {};
+      std::size_t size = 0;
+      auto end = boost::asio::buffer_sequence_end(buffers);
+      for (auto it = boost::asio::buffer_sequence_begin(buffers);
+           it != end && !ec; ++it) {
+        boost::asio::const_buffer buffer = *it;
+        size += buffer.size();
+        if (decoder_) {
+          decoder_->Decode(buffer, body_.data, max_size(size), ec);
+        } else {
+          body_.data.append(static_cast<const char*>(buffer.data()),
+                            buffer.size());
+        }
+      }
+      encoded_ += size;
+      return size;
+    }
+
+    void finish(boost::beast::error_code& ec) {
+      ec = {};
+      if (decoder_) {
+        if (!decoder_->is_done()) {
+          ec = boost::beast::http::error::partial_message;
+          return;
+        }
+        body_.decoded = true;
+      }
+    }
+
+   private:
+    // The inflated size allowed with pending more encoded bytes
+    std::size_t max_size(std::size_t pending) const noexcept {
+      constexpr std::uint64_t kRatioFloor = 4 * 1024;
+      auto max_size = body_.limit;
+      if (body_.max_ratio > 0) {
+        auto encoded = std::max(encoded_ + pending, kRatioFloor);
+        max_size = std::min(max_size, encoded * body_.max_ratio);
+      }
+      return static_cast<std::size_t>(std::min<std::uint64_t>(
+          max_size, std::numeric_limits<std::size_t>::max() - 1));
+    }
+
+    value_type& body_;
+    std::optional<HttpInflateDecoder> decoder_;
+    std::uint64_t encoded_ = 0;
+  };
+};
+
+}  // namespace pirest
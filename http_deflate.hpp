@@ -0,0 +1,283 @@
+#pragma once
+#include <algorithm>
+#include <boost/asio/buffer.hpp>
+#include <boost/beast/http/error.hpp>
+#include <boost/beast/zlib/deflate_stream.hpp>
+#include <boost/beast/zlib/inflate_stream.hpp>
+#include <boost/crc.hpp>
+#include <cstdint>
+#include <string>
+
+namespace pirest {
+
+// gzip (RFC 1952) or zlib (RFC 1950, the deflate coding of HTTP), both
+// around a raw deflate stream.
+enum class HttpDeflateFormat { kGzip, kDeflate };
+
+// The CRC-32 of gzip or the Adler-32 of zlib, and the size, of a stream.
+class HttpDeflateChecksum {
+ public:
+  explicit HttpDeflateChecksum(HttpDeflateFormat format) noexcept
+      : format_{format} {}
+
+  void Update(const void* data, std::size_t size) noexcept {
+    auto bytes = static_cast<const unsigned char*>(data);
+    size_ += static_cast<std::uint32_t>(size);
+    if (format_ == HttpDeflateFormat::kGzip) {
+      crc_.process_bytes(bytes, size);
+      return;
+    }
+    // The sums stay below 2^32 for 5552 bytes between reductions
+    constexpr std::uint32_t kBase = 65521;
+    for (std::size_t pos = 0; pos < size;) {
+      auto end = std::min(size, pos + 5552);
+      for (; pos < end; ++pos) {
+        adler_a_ += bytes[pos];
+        adler_b_ += adler_a_;
+      }
+      adler_a_ %= kBase;
+      adler_b_ %= kBase;
+    }
+  }
+
+  // The trailer of the format
+  void AppendTrailer(std::string& out) const {
+    if (format_ == HttpDeflateFormat::kGzip) {
+      AppendLittleEndian(crc_.checksum(), out);
+      AppendLittleEndian(size_, out);
+      return;
+    }
+    auto adler = adler_b_ << 16 | adler_a_;
+    for (auto shift : {24, 16, 8, 0}) {
+      out.push_back(static_cast<char>(adler >> shift));
+    }
+  }
+
+  static std::size_t trailer_size(HttpDeflateFormat format) noexcept {
+    return format == HttpDeflateFormat::kGzip ? 8 : 4;
+  }
+
+ private:
+  static void AppendLittleEndian(std::uint32_t value, std::string& out) {
+    for (auto shift : {0, 8, 16, 24}) {
+      out.push_back(static_cast<char>(value >> shift));
+    }
+  }
+
+  HttpDeflateFormat format_;
+  boost::crc_32_type crc_;
+  std::uint32_t adler_a_ = 1;
+  std::uint32_t adler_b_ = 0;
+  std::uint32_t size_ = 0;
+};
+
+// Compresses a stream with the raw deflate of beast::zlib.
+class HttpDeflateEncoder {
+ public:
+  HttpDeflateEncoder(HttpDeflateFormat format, int level) {
+    Reset(format, level);
+  }
+
+  // Starts a new stream, the window memory stays for it
+  void Reset(HttpDeflateFormat format, int level) {
+    stream_.reset(level, 15, 8, boost::beast::zlib::Strategy::normal);
+    format_ = format;
+    checksum_ = HttpDeflateChecksum{format};
+    started_ = false;
+  }
+
+  // Appends the compressed data to out. Every call but the last ends with a
+  // sync flush, so what a chunk holds reaches the client with it.
+  void Encode(boost::asio::const_buffer data, bool last, std::string& out) {
+    if (!started_) {
+      started_ = true;
+      if (format_ == HttpDeflateFormat::kGzip) {
+        out.append("\x1f\x8b\x08\x00\x00\x00\x00\x00\x00\xff", 10);
+      } else {
+        out.append("\x78\x9c", 2);
+      }
+    }
+    checksum_.Update(data.data(), data.size());
+    boost::beast::zlib::z_params zs;
+    // deflate wants a valid pointer even without input
+    zs.next_in = data.size() > 0 ? data.data() : out.data();
+    zs.avail_in = data.size();
+    auto flush = last ? boost::beast::zlib::Flush::finish
+                      : boost::beast::zlib::Flush::sync;
+    while (true) {
+      auto offset = out.size();
+      out.resize(offset + stream_.upper_bound(zs.avail_in) + 16);
+      zs.next_out = out.data() + offset;
+      zs.avail_out = out.size() - offset;
+      boost::beast::error_code ec;
+      stream_.write(zs, flush, ec);
+      out.resize(out.size() - zs.avail_out);
+      if (ec == boost::beast::zlib::error::end_of_stream ||
+          (!last && zs.avail_out > 0) ||
+          (ec && ec != boost::beast::zlib::error::need_buffers)) {
+        break;
+      }
+    }
+    if (last) {
+      checksum_.AppendTrailer(out);
+    }
+  }
+
+ private:
+  boost::beast::zlib::deflate_stream stream_;
+  HttpDeflateFormat format_ = HttpDeflateFormat::kGzip;
+  HttpDeflateChecksum checksum_{HttpDeflateFormat::kGzip};
+  bool started_ = false;
+};
+
+// Inflates a stream fed in pieces of any size and checks its trailer.
+class HttpInflateDecoder {
+ public:
+  explicit HttpInflateDecoder(HttpDeflateFormat format)
+      : format_{format}, checksum_{format} {
+    stream_.reset(15);
+  }
+
+  bool is_done() const noexcept { return state_ == State::kDone; }
+
+  // Appends what data inflates to to out. Fails with body_limit as soon as
+  // out would grow past max_size, so a bomb never gets further.
+  void Decode(boost::asio::const_buffer data, std::string& out,
+              std::size_t max_size, boost::beast::error_code& ec) {
+    ec = {};
+    if (state_ == State::kHeader) {
+      header_.append(static_cast<const char*>(data.data()), data.size());
+      auto size = ParseHeader(ec);
+      if (ec || size == 0) {
+        return;
+      }
+      state_ = State::kBody;
+      auto header = std::move(header_);
+      header_.clear();
+      return Decode(boost::asio::buffer(header.data() + size,
+                                        header.size() - size),
+                    out, max_size, ec);
+    }
+    boost::beast::zlib::z_params zs;
+    zs.next_in = data.data();
+    zs.avail_in = data.size();
+    // A full out may leave output behind even without more input
+    bool full = false;
+    while (state_ == State::kBody && (zs.avail_in > 0 || full)) {
+      auto offset = out.size();
+      // One byte past max_size tells a full body from a bigger one
+      out.resize(offset + std::min<std::size_t>(16 * 1024,
+                                                max_size + 1 - offset));
+      zs.next_out = out.data() + offset;
+      zs.avail_out = out.size() - offset;
+      stream_.write(zs, boost::beast::zlib::Flush::sync, ec);
+      full = zs.avail_out == 0;
+      out.resize(out.size() - zs.avail_out);
+      checksum_.Update(out.data() + offset, out.size() - offset);
+      if (out.size() > max_size) {
+        ec = boost::beast::http::error::body_limit;
+        return;
+      }
+      if (ec == boost::beast::zlib::error::end_of_stream) {
+        state_ = State::kTrailer;
+      } else if (ec == boost::beast::zlib::error::need_buffers) {
+        break;
+      } else if (ec) {
+        return;
+      }
+    }
+    ec = {};
+    if (state_ == State::kBody) {
+      return;
+    }
+    auto input = static_cast<const char*>(zs.next_in);
+    if (state_ == State::kDone) {
+      if (zs.avail_in > 0) {
+        ec = boost::beast::zlib::error::general;
+      }
+      return;
+    }
+    auto trailer_size = HttpDeflateChecksum::trailer_size(format_);
+    auto size = std::min(zs.avail_in, trailer_size - trailer_.size());
+    trailer_.append(input, size);
+    if (zs.avail_in > size) {
+      // Concatenated gzip members aren't supported
+      ec = boost::beast::zlib::error::general;
+    } else if (trailer_.size() == trailer_size) {
+      std::string expected;
+      checksum_.AppendTrailer(expected);
+      if (expected != trailer_) {
+        ec = boost::beast::zlib::error::general;
+      }
+      state_ = State::kDone;
+    }
+  }
+
+ private:
+  enum class State { kHeader, kBody, kTrailer, kDone };
+
+  // The size of a complete header in header_, 0 while it is incomplete
+  std::size_t ParseHeader(boost::beast::error_code& ec) {
+    auto bytes = reinterpret_cast<const unsigned char*>(header_.data());
+    if (format_ == HttpDeflateFormat::kDeflate) {
+      if (header_.size() < 2) {
+        return 0;
+      }
+      // Deflate with a window of at most 32K and no preset dictionary
+      if ((bytes[0] & 0x0f) != 8 || (bytes[0] >> 4) > 7 ||
+          (bytes[0] << 8 | bytes[1]) % 31 != 0 || (bytes[1] & 0x20)) {
+        ec = boost::beast::zlib::error::general;
+      }
+      return 2;
+    }
+    constexpr std::size_t kMaxHeader = 4096;
+    if (header_.size() < 10) {
+      return 0;
+    }
+    if (bytes[0] != 0x1f || bytes[1] != 0x8b || bytes[2] != 8) {
+      ec = boost::beast::zlib::error::general;
+      return 0;
+    }
+    auto flags = bytes[3];
+    std::size_t size = 10;
+    if (flags & 0x04) {
+      // FEXTRA
+      if (header_.size() < size + 2) {
+        return 0;
+      }
+      size += 2 + (bytes[size] | bytes[size + 1] << 8);
+    }
+    for (auto flag : {0x08, 0x10}) {
+      // FNAME and FCOMMENT end with a zero
+      if (flags & flag) {
+        auto end = size < header_.size() ? header_.find('\0', size)
+                                         : std::string::npos;
+        if (end == std::string::npos) {
+          size = header_.size() + 1;
+          break;
+        }
+        size = end + 1;
+      }
+    }
+    if (flags & 0x02) {
+      // FHCRC
+      size += 2;
+    }
+    if (size > header_.size()) {
+      if (header_.size() > kMaxHeader) {
+        ec = boost::beast::zlib::error::general;
+      }
+      return 0;
+    }
+    return size;
+  }
+
+  HttpDeflateFormat format_;
+  boost::beast::zlib::inflate_stream stream_;
+  HttpDeflateChecksum checksum_;
+  State state_ = State::kHeader;
+  std::string header_;
+  std::string trailer_;
+};
+
+}  // namespace pirest
@@ -0,0 +1,84 @@
+#pragma once
+#include <algorithm>
+#include <boost/asio/error.hpp>
+#include <boost/beast/core/file.hpp>
+#include <boost/beast/http/basic_file_body.hpp>
+#include <cstdint>
+
+namespace pirest {
+
+// The File of HttpFileBody, a window [offset, offset + size) of a file. The
+// body only sees the window, so a range goes through file_body unchanged.
+class HttpFileSlice {
+ public:
+  using native_handle_type = boost::beast::file::native_handle_type;
+
+  bool is_open() const { return file_.is_open(); }
+
+  native_handle_type native_handle() const { return file_.native_handle(); }
+
+  void close(boost::beast::error_code& ec) { file_.close(ec); }
+
+  void open(const char* path, boost::beast::file_mode mode,
+            boost::beast::error_code& ec) {
+    file_.open(path, mode, ec);
+    if (!ec) {
+      Select(0, file_.size(ec), ec);
+    }
+  }
+
+  // Narrows the slice to [offset, offset + size) of the file
+  void Select(std::uint64_t offset, std::uint64_t size,
+              boost::beast::error_code& ec) {
+    file_.seek(offset, ec);
+    offset_ = offset;
+    size_ = size;
+    pos_ = 0;
+  }
+
+  std::uint64_t size(boost::beast::error_code& ec) const {
+    ec = {};
+    return size_;
+  }
+
+  std::uint64_t pos(boost::beast::error_code& ec) const {
+    ec = {};
+    return pos_;
+  }
+
+  void seek(std::uint64_t offset, boost::beast::error_code& ec) {
+    file_.seek(offset_ + offset, ec);
+    if (!ec) {
+      pos_ = offset;
+    }
+  }
+
+  std::size_t read(void* buffer, std::size_t n, boost::beast::error_code& ec) {
+    n = static_cast<std::size_t>(std::min<std::uint64_t>(n, size_ - pos_));
+    auto read = file_.read(buffer, n, ec);
+    pos_ += read;
+    return read;
+  }
+
+  std::size_t write(const void*, std::size_t, boost::beast::error_code& ec) {
+    ec = boost::asio::error::operation_not_supported;
+    return 0;
+  }
+
+  // For sendfile, which takes a file offset and leaves the file position alone
+  std::uint64_t file_offset() const noexcept { return offset_ + pos_; }
+
+  std::uint64_t remaining() const noexcept { return size_ - pos_; }
+
+  void Advance(std::uint64_t n) noexcept { pos_ += n; }
+
+ private:
+  boost::beast::file file_;
+  std::uint64_t offset_ = 0;
+  std::uint64_t size_ = 0;
+  std::uint64_t pos_ = 0;
+};
+
+using HttpFileBody = boost::beast::http::basic_file_body<HttpFileSlice>;
+
+}  // namespace pirest
@@ -0,0 +1,353 @@
+#pragma once
+#include <boost/beast/http/empty_body.hpp>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <optional>
+#include <pirest/http_argument.hpp>
+#include <pirest/http_connection.hpp>
+#include <pirest/http_file_body.hpp>
+#include <pirest/http_utils.hpp>
+#include <string>
+#include <string_view>
+
+namespace pirest {
+
+// IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+static std::string FormatHttpDate(std::chrono::sys_seconds time) {
+  static const char* kDays[] = {"Sun", "Mon", "Tue", "Wed",
+                                "Thu", "Fri", "Sat"};
+  static const char* kMonths[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                  "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+  auto days = std::chrono::floor<std::chrono::days>(time);
+  std::chrono::year_month_day ymd{days};
+  std::chrono::hh_mm_ss hms{time - days};
+  char buffer[32];
+  std::snprintf(buffer, sizeof(buffer), "%s, %02u %s %04d %02d:%02d:%02d GMT",
+                kDays[std::chrono::weekday{days}.c_encoding()],
+                static_cast<unsigned>(ymd.day()),
+                kMonths[static_cast<unsigned>(ymd.month()) - 1],
+                static_cast<int>(ymd.year()),
+                static_cast<int>(hms.hours().count()),
+                static_cast<int>(hms.minutes().count()),
+                static_cast<int>(hms.seconds().count()));
+  return buffer;
+}
+
+// Only IMF-fixdate, the obsolete formats are treated as absent
+static std::optional<std::chrono::sys_seconds> ParseHttpDate(
+    std::string_view str) {
+  static const std::string_view kMonths =
+      "JanFebMarAprMayJunJulAugSepOctNovDec";
+  char week_day[4];
+  char month_name[4];
+  unsigned day = 0;
+  int year = 0;
+  int hour = 0;
+  int minute = 0;
+  int second = 0;
+  std::string date{str};
+  if (std::sscanf(date.c_str(), "%3s, %u %3s %d %d:%d:%d GMT", week_day, &day,
+                  month_name, &year, &hour, &minute, &second) != 7) {
+    return std::nullopt;
+  }
+  auto pos = kMonths.find(month_name);
+  if (pos == kMonths.npos || pos % 3 != 0) {
+    return std::nullopt;
+  }
+  std::chrono::year_month_day ymd{
+      std::chrono::year{year},
+      std::chrono::month{static_cast<unsigned>(pos / 3 + 1)},
+      std::chrono::day{day}};
+  if (!ymd.ok()) {
+    return std::nullopt;
+  }
+  return std::chrono::sys_days{ymd} + std::chrono::hours{hour} +
+         std::chrono::minutes{minute} + std::chrono::seconds{second};
+}
+
+// Serves the files under root from a "{*}" route, e.g.
+//   server.HandleFunc("/static/{*}", HttpFileHandler{"/var/www"},
+//                     {"GET", "HEAD"});
+// Conditional requests are answered from the file status without opening the
+// file. A single Range is honored, several are answered with the whole file.
+class HttpFileHandler {
+ public:
+  explicit HttpFileHandler(std::filesystem::path root)
+      : root_{std::move(root)} {}
+
+  void operator()(const HttpConnection::Ptr& conn,
+                  const std::string& path) const {
+    const auto& req = conn->request();
+    std::filesystem::path file_path;
+    if (!ResolvePath(path, file_path)) {
+      return conn->Respond(boost::beast::http::status::not_found,
+                           "Not found", "text/plain");
+    }
+    std::error_code ec;
+    if (!std::filesystem::is_regular_file(file_path, ec)) {
+      return conn->Respond(boost::beast::http::status::not_found,
+                           "Not found", "text/plain");
+    }
+    auto size = std::filesystem::file_size(file_path, ec);
+    auto write_time = std::filesystem::last_write_time(file_path, ec);
+    if (ec) {
+      return conn->Respond(boost::beast::http::status::not_found,
+                           "Not found", "text/plain");
+    }
+    auto modified = std::chrono::time_point_cast<std::chrono::seconds>(
+        std::chrono::file_clock::to_sys(write_time));
+    auto etag = MakeETag(size, modified);
+    auto last_modified = FormatHttpDate(modified);
+
+    if (IsNotModified(req, etag, modified)) {
+      HttpResponse<boost::beast::http::empty_body> resp{
+          boost::beast::http::status::not_modified, req.version()};
+      resp.keep_alive(req.keep_alive());
+      resp.set(boost::beast::http::field::etag, etag);
+      resp.set(boost::beast::http::field::last_modified, last_modified);
+      // The length of the 200 response, there is no body either way
+      resp.content_length(size);
+      return conn->Respond(std::move(resp));
+    }
+
+    std::uint64_t offset = 0;
+    auto length = size;
+    auto status = boost::beast::http::status::ok;
+    auto range = req.find(boost::beast::http::field::range);
+    if (range != req.end() && req.method() == boost::beast::http::verb::get &&
+        IsRangeFresh(req, etag, last_modified)) {
+      switch (ParseRange(range->value(), size, offset, length)) {
+        case RangeResult::kIgnored:
+          break;
+        case RangeResult::kSatisfiable:
+          status = boost::beast::http::status::partial_content;
+          break;
+        case RangeResult::kUnsatisfiable:
+          return conn->Respond(
+              boost::beast::http::status::range_not_satisfiable,
+              {{"Content-Range", "bytes */" + std::to_string(size)}});
+      }
+    }
+
+    auto content_type = ContentType(file_path.extension().string());
+    if (req.method() == boost::beast::http::verb::head) {
+      HttpResponse<boost::beast::http::empty_body> resp{status,
+                                                        req.version()};
+      SetHeaders(req, resp, content_type, etag, last_modified, offset, length,
+                 size);
+      return conn->Respond(std::move(resp));
+    }
+    HttpFileSlice file;
+    boost::beast::error_code file_ec;
+    file.open(file_path.string().c_str(), boost::beast::file_mode::scan,
+              file_ec);
+    if (!file_ec) {
+      file.Select(offset, length, file_ec);
+    }
+    HttpResponse<HttpFileBody> resp{status, req.version()};
+    if (!file_ec) {
+      resp.body().reset(std::move(file), file_ec);
+    }
+    if (file_ec) {
+      return conn->Respond(boost::beast::http::status::not_found,
+                           "Not found", "text/plain");
+    }
+    SetHeaders(req, resp, content_type, etag, last_modified, offset, length,
+               size);
+    conn->Respond(std::move(resp));
+  }
+
+ private:
+  enum class RangeResult { kIgnored, kSatisfiable, kUnsatisfiable };
+
+  // The path comes percent-decoded from the route, ".." and absolute paths
+  // would leave root.
+  bool ResolvePath(std::string_view path,
+                   std::filesystem::path& file_path) const {
+    if (path.find('\0') != path.npos || path.find('\\') != path.npos) {
+      return false;
+    }
+    file_path = root_;
+    while (!path.empty()) {
+      auto segment = path.substr(0, path.find('/'));
+      path.remove_prefix(std::min(segment.size() + 1, path.size()));
+      if (segment.empty() || segment == ".") {
+        continue;
+      }
+      if (segment == ".." || std::filesystem::path{segment}.has_root_name()) {
+        return false;
+      }
+      file_path /= segment;
+    }
+    std::error_code ec;
+    if (std::filesystem::is_directory(file_path, ec)) {
+      file_path /= "index.html";
+    }
+    return true;
+  }
+
+  static std::string MakeETag(std::uint64_t size,
+                              std::chrono::sys_seconds modified) {
+    char buffer[48];
+    std::snprintf(buffer, sizeof(buffer), "\"%llx-%llx\"",
+                  static_cast<unsigned long long>(
+                      modified.time_since_epoch().count()),
+                  static_cast<unsigned long long>(size));
+    return buffer;
+  }
+
+  // Whether list, an If-None-Match value, names etag. Weak tags compare by
+  // their opaque part.
+  static bool MatchETag(std::string_view list, std::string_view etag) {
+    while (!list.empty()) {
+      auto tag = list.substr(0, list.find(','));
+      list.remove_prefix(std::min(tag.size() + 1, list.size()));
+      while (!tag.empty() && tag.front() == ' ') {
+        tag.remove_prefix(1);
+      }
+      while (!tag.empty() && tag.back() == ' ') {
+        tag.remove_suffix(1);
+      }
+      if (tag == "*") {
+        return true;
+      }
+      if (tag.substr(0, 2) == "W/") {
+        tag.remove_prefix(2);
+      }
+      if (tag == etag) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static bool IsNotModified(const HttpRequest& req, std::string_view etag,
+                            std::chrono::sys_seconds modified) {
+    if (req.method() != boost::beast::http::verb::get &&
+        req.method() != boost::beast::http::verb::head) {
+      return false;
+    }
+    auto it = req.find(boost::beast::http::field::if_none_match);
+    if (it != req.end()) {
+      return MatchETag(it->value(), etag);
+    }
+    it = req.find(boost::beast::http::field::if_modified_since);
+    if (it != req.end()) {
+      auto since = ParseHttpDate(it->value());
+      return since && modified <= *since;
+    }
+    return false;
+  }
+
+  // If-Range needs an exact (strong) match, else the whole file is sent
+  static bool IsRangeFresh(const HttpRequest& req, std::string_view etag,
+                           std::string_view last_modified) {
+    auto it = req.find(boost::beast::http::field::if_range);
+    if (it == req.end()) {
+      return true;
+    }
+    std::string_view value = it->value();
+    return value == etag || value == last_modified;
+  }
+
+  // A single "bytes=first-last", "bytes=first-" or "bytes=-suffix"
+  static RangeResult ParseRange(std::string_view value, std::uint64_t size,
+                                std::uint64_t& offset, std::uint64_t& length) {
+    constexpr std::string_view kPrefix = "bytes=";
+    if (!IStartsWith(value, kPrefix) || value.find(',') != value.npos) {
+      return RangeResult::kIgnored;
+    }
+    value.remove_prefix(kPrefix.size());
+    auto dash = value.find('-');
+    if (dash == value.npos) {
+      return RangeResult::kIgnored;
+    }
+    auto first_str = value.substr(0, dash);
+    auto last_str = value.substr(dash + 1);
+    std::uint64_t first = 0;
+    std::uint64_t last = 0;
+    if (first_str.empty()) {
+      if (!ArgumentParser<std::uint64_t>::Parse(last_str, last)) {
+        return RangeResult::kIgnored;
+      }
+      if (last == 0 || size == 0) {
+        return RangeResult::kUnsatisfiable;
+      }
+      length = std::min(last, size);
+      offset = size - length;
+      return RangeResult::kSatisfiable;
+    }
+    if (!ArgumentParser<std::uint64_t>::Parse(first_str, first)) {
+      return RangeResult::kIgnored;
+    }
+    if (last_str.empty()) {
+      last = size > 0 ? size - 1 : 0;
+    } else if (!ArgumentParser<std::uint64_t>::Parse(last_str, last) ||
+               last < first) {
+      return RangeResult::kIgnored;
+    }
+    if (first >= size) {
+      return RangeResult::kUnsatisfiable;
+    }
+    offset = first;
+    length = std::min(last, size - 1) - first + 1;
+    return RangeResult::kSatisfiable;
+  }
+
+  static const char* ContentType(std::string_view extension) {
+    static const std::pair<std::string_view, const char*> kTypes[] = {
+        {".html", "text/html"},
+        {".htm", "text/html"},
+        {".css", "text/css"},
+        {".js", "application/javascript"},
+        {".mjs", "application/javascript"},
+        {".json", "application/json"},
+        {".txt", "text/plain"},
+        {".xml", "application/xml"},
+        {".svg", "image/svg+xml"},
+        {".png", "image/png"},
+        {".jpg", "image/jpeg"},
+        {".jpeg", "image/jpeg"},
+        {".gif", "image/gif"},
+        {".webp", "image/webp"},
+        {".ico", "image/x-icon"},
+        {".wasm", "application/wasm"},
+        {".pdf", "application/pdf"},
+        {".woff", "font/woff"},
+        {".woff2", "font/woff2"},
+        {".mp4", "video/mp4"},
+        {".zip", "application/zip"},
+    };
+    for (const auto& type : kTypes) {
+      if (IEquals(extension, type.first)) {
+        return type.second;
+      }
+    }
+    return "application/octet-stream";
+  }
+
+  template <class Body>
+  static void SetHeaders(const HttpRequest& req, HttpResponse<Body>& resp,
+                         const char* content_type, const std::string& etag,
+                         const std::string& last_modified,
+                         std::uint64_t offset, std::uint64_t length,
+                         std::uint64_t size) {
+    resp.keep_alive(req.keep_alive());
+    resp.set(boost::beast::http::field::content_type, content_type);
+    resp.set(boost::beast::http::field::accept_ranges, "bytes");
+    resp.set(boost::beast::http::field::etag, etag);
+    resp.set(boost::beast::http::field::last_modified, last_modified);
+    if (resp.result() == boost::beast::http::status::partial_content) {
+      resp.set(boost::beast::http::field::content_range,
+               "bytes " + std::to_string(offset) + "-" +
+                   std::to_string(offset + length - 1) + "/" +
+                   std::to_string(size));
+    }
+    resp.content_length(length);
+  }
+
+  std::filesystem::path root_;
+};
+
+}  // namespace pirest
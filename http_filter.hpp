@@ -1,5 +1,8 @@
 #pragma once
 #include <pirest/http_connection.hpp>
+#include <pirest/http_utils.hpp>
+#include <string>
+#include <string_view>
 
 namespace pirest {
 
@@ -13,8 +16,36 @@ class HttpFilter {
 
   virtual Result OnIncomingRequest(const HttpConnection::Ptr& conn) = 0;
 
-  virtual void OnOutgingResponse(const HttpConnection::Ptr& conn,
-                                 boost::beast::http::response_header<>& resp) {}
+  virtual void OnOutgingResponse(const HttpConnection::Ptr& /*conn*/,
+                                 HttpResponseHeader& /*resp*/) {}
+
+  // Runs after every filter's OnOutgingResponse. body is the body of a string
+  // response, which the filter may read or replace, null for other bodies.
+  virtual void OnOutgingBody(const HttpConnection::Ptr& /*conn*/,
+                             HttpResponseHeader& /*resp*/,
+                             std::string* /*body*/) {}
+
+  // Runs for chunked responses after every filter's OnOutgingBody. The
+  // returned encoder sees every chunk the handler writes, in filter order.
+  virtual std::unique_ptr<HttpBodyEncoder> OnOutgingChunked(
+      const HttpConnection::Ptr& /*conn*/, HttpResponseHeader& /*resp*/) {
+    return nullptr;
+  }
+
+ protected:
+  // Adds header to the Vary of resp unless it is there or Vary is "*"
+  static void AddVary(HttpResponseHeader& resp, std::string_view header) {
+    std::string_view vary = resp[boost::beast::http::field::vary];
+    if (vary.empty()) {
+      resp.set(boost::beast::http::field::vary, header);
+    } else if (AllListItems(vary, [header](std::string_view item) {
+                 return item != "*" && !IEquals(item, header);
+               })) {
+      std::string value{vary};
+      value.append(", ").append(header);
+      resp.set(boost::beast::http::field::vary, value);
+    }
+  }
 };
 
 }  // namespace pirest
@@ -0,0 +1,236 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace pirest {
+
+// Counters are split in shards, each thread adds to its own with a relaxed
+// increment and readers sum them up.
+constexpr std::size_t kHttpMetricsShards = 8;
+
+static std::size_t HttpMetricsShard() noexcept {
+  static std::atomic<std::size_t> next{0};
+  thread_local std::size_t shard =
+      next.fetch_add(1, std::memory_order_relaxed) % kHttpMetricsShards;
+  return shard;
+}
+
+class HttpCounter {
+ public:
+  void Add(std::uint64_t n = 1) noexcept {
+    shards_[HttpMetricsShard()].value.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  std::uint64_t value() const noexcept {
+    std::uint64_t value = 0;
+    for (const auto& shard : shards_) {
+      value += shard.value.load(std::memory_order_relaxed);
+    }
+    return value;
+  }
+
+ private:
+  struct alignas(64) Shard {
+    std::atomic<std::uint64_t> value{0};
+  };
+
+  std::array<Shard, kHttpMetricsShards> shards_;
+};
+
+// Latencies and status classes of the responses of one route. Buckets are
+// two per power of two microseconds, [2^e, 1.5 * 2^e) and [1.5 * 2^e,
+// 2^(e+1)), up to about 2 hours. The shards are allocated on first use, so
+// a route costs a pointer until metrics are enabled.
+class HttpRouteMetrics {
+ public:
+  static constexpr std::size_t kBuckets = 67;
+
+  struct Snapshot {
+    std::array<std::uint64_t, kBuckets> buckets{};
+    std::array<std::uint64_t, 5> statuses{};
+    std::uint64_t sum_us = 0;
+    std::uint64_t count = 0;
+  };
+
+  HttpRouteMetrics() noexcept = default;
+
+  HttpRouteMetrics(const HttpRouteMetrics&) = delete;
+
+  ~HttpRouteMetrics() noexcept { delete[] shards_.load(); }
+
+  void Record(unsigned status,
+              std::chrono::steady_clock::duration latency) noexcept {
+    auto shards = shards_.load(std::memory_order_acquire);
+    if (!shards) {
+      shards = Allocate();
+    }
+    auto us = static_cast<std::uint64_t>(std::max<std::int64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(latency).count(),
+        0));
+    auto& shard = shards[HttpMetricsShard()];
+    shard.buckets[Bucket(us)].fetch_add(1, std::memory_order_relaxed);
+    shard.sum_us.fetch_add(us, std::memory_order_relaxed);
+    if (status >= 100 && status < 600) {
+      shard.statuses[status / 100 - 1].fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  // False while nothing was recorded
+  bool Collect(Snapshot& snapshot) const noexcept {
+    auto shards = shards_.load(std::memory_order_acquire);
+    if (!shards) {
+      return false;
+    }
+    snapshot = {};
+    for (std::size_t i = 0; i < kHttpMetricsShards; ++i) {
+      for (std::size_t j = 0; j < kBuckets; ++j) {
+        auto n = shards[i].buckets[j].load(std::memory_order_relaxed);
+        snapshot.buckets[j] += n;
+        snapshot.count += n;
+      }
+      for (std::size_t j = 0; j < snapshot.statuses.size(); ++j) {
+        snapshot.statuses[j] +=
+            shards[i].statuses[j].load(std::memory_order_relaxed);
+      }
+      snapshot.sum_us += shards[i].sum_us.load(std::memory_order_relaxed);
+    }
+    return true;
+  }
+
+  static std::size_t Bucket(std::uint64_t us) noexcept {
+    if (us == 0) {
+      return 0;
+    }
+    auto exp = static_cast<std::size_t>(std::bit_width(us) - 1);
+    if (exp > 32) {
+      return kBuckets - 1;
+    }
+    auto upper_half = exp > 0 && (us >> (exp - 1) & 1);
+    return 2 * exp + 1 + upper_half;
+  }
+
+  // Exclusive upper bound of bucket in microseconds
+  static double UpperBound(std::size_t bucket) noexcept {
+    if (bucket == 0) {
+      return 1;
+    }
+    auto exp = (bucket - 1) / 2;
+    auto power = static_cast<double>(std::uint64_t{1} << exp);
+    return (bucket - 1) % 2 == 0 ? power * 1.5 : power * 2;
+  }
+
+ private:
+  struct alignas(64) Shard {
+    std::atomic<std::uint64_t> buckets[kBuckets];
+    std::atomic<std::uint64_t> statuses[5];
+    std::atomic<std::uint64_t> sum_us;
+  };
+
+  Shard* Allocate() noexcept {
+    auto shards = new Shard[kHttpMetricsShards]();
+    Shard* expected = nullptr;
+    if (!shards_.compare_exchange_strong(expected, shards,
+                                         std::memory_order_acq_rel)) {
+      delete[] shards;
+      return expected;
+    }
+    return shards;
+  }
+
+  std::atomic<Shard*> shards_{nullptr};
+};
+
+// Server wide metrics, and the route metrics of requests that no route
+// handled: those answered by a filter, not found or rejected.
+class HttpMetrics {
+ public:
+  void OnConnect() noexcept { connections_.Add(); }
+
+  void OnDisconnect() noexcept { disconnections_.Add(); }
+
+  void OnWrite(std::size_t bytes) noexcept { bytes_written_.Add(bytes); }
+
+  HttpRouteMetrics& unrouted() noexcept { return unrouted_; }
+
+  // Appends the Prometheus text format. for_each_route(visitor) calls
+  // visitor(pattern, const HttpRouteMetrics&) for every route.
+  template <class ForEachRoute>
+  void Export(std::string& out, ForEachRoute&& for_each_route) const {
+    auto connections = connections_.value();
+    auto disconnections = disconnections_.value();
+    out += "# TYPE pirest_connections_total counter\n";
+    out += "pirest_connections_total " + std::to_string(connections) + "\n";
+    out += "# TYPE pirest_connections_active gauge\n";
+    out += "pirest_connections_active " +
+           std::to_string(connections - std::min(connections, disconnections)) +
+           "\n";
+    out += "# TYPE pirest_response_bytes_total counter\n";
+    out += "pirest_response_bytes_total " +
+           std::to_string(bytes_written_.value()) + "\n";
+
+    out += "# TYPE pirest_requests_total counter\n";
+    std::string durations =
+        "# TYPE pirest_request_duration_seconds histogram\n";
+    HttpRouteMetrics::Snapshot snapshot;
+    auto visitor = [&](std::string_view pattern,
+                       const HttpRouteMetrics& metrics) {
+      if (!metrics.Collect(snapshot)) {
+        return;
+      }
+      std::string route = "route=\"";
+      for (auto c : pattern) {
+        if (c == '"' || c == '\\') {
+          route.push_back('\\');
+        }
+        route.push_back(c);
+      }
+      route.push_back('"');
+      for (std::size_t i = 0; i < snapshot.statuses.size(); ++i) {
+        if (snapshot.statuses[i] > 0) {
+          out += "pirest_requests_total{" + route + ",code=\"" +
+                 std::to_string(i + 1) + "xx\"} " +
+                 std::to_string(snapshot.statuses[i]) + "\n";
+        }
+      }
+      std::uint64_t count = 0;
+      for (std::size_t i = 0; i + 1 < HttpRouteMetrics::kBuckets; ++i) {
+        count += snapshot.buckets[i];
+        durations += "pirest_request_duration_seconds_bucket{" + route +
+                     ",le=\"" +
+                     FormatSeconds(HttpRouteMetrics::UpperBound(i)) + "\"} " +
+                     std::to_string(count) + "\n";
+      }
+      durations += "pirest_request_duration_seconds_bucket{" + route +
+                   ",le=\"+Inf\"} " + std::to_string(snapshot.count) + "\n";
+      durations += "pirest_request_duration_seconds_sum{" + route + "} " +
+                   FormatSeconds(static_cast<double>(snapshot.sum_us)) + "\n";
+      durations += "pirest_request_duration_seconds_count{" + route + "} " +
+                   std::to_string(snapshot.count) + "\n";
+    };
+    visitor("", unrouted_);
+    for_each_route(visitor);
+    out += durations;
+  }
+
+ private:
+  static std::string FormatSeconds(double us) {
+    char buffer[32];
+    auto size = std::snprintf(buffer, sizeof(buffer), "%.9g", us / 1e6);
+    return std::string(buffer, static_cast<std::size_t>(size));
+  }
+
+  HttpCounter connections_;
+  HttpCounter disconnections_;
+  HttpCounter bytes_written_;
+  HttpRouteMetrics unrouted_;
+};
+
+}  // namespace pirest
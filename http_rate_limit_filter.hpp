@@ -0,0 +1,217 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <pirest/http_connection_impl.hpp>
+#include <pirest/http_filter.hpp>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace pirest {
+
+// Limits each client to rate requests per second with bursts of up to burst,
+// the excess gets 429 with Retry-After. A client is the value of key_header,
+// e.g. an API key, if is_valid accepts it, else its address. Unchecked values
+// would let a client pick a fresh bucket per request. A rate of 0 or less
+// disables the limit.
+//
+// A key's token bucket is kept as the time it will be full again (GCRA). A
+// request takes a token by moving that time one interval on with a CAS, the
+// refill follows from the clock and no thread runs in the background. The
+// buckets live in a table of fixed size split in shards of 8 slots, a key
+// only in the shard its hash picks, so a request touches two cache lines and
+// takes no lock. A full bucket is as good as none, so a new key takes over a
+// slot whose bucket is full, or else the one closest to full. Keys are told
+// apart by a 64 bit hash.
+class HttpRateLimitFilter : public HttpFilter {
+ public:
+  // Room for about max_keys clients active at the same time
+  explicit HttpRateLimitFilter(std::size_t max_keys = 64 * 1024)
+      : shard_num_{std::bit_ceil(std::max<std::size_t>(max_keys / 4, 1))},
+        shards_{std::make_unique<Shard[]>(shard_num_)},
+        start_{std::chrono::steady_clock::now()} {
+    for (std::uint64_t i = 1; i <= kCannedRetries; ++i) {
+      canned_.emplace_back(TooManyRequests(i));
+    }
+  }
+
+  const char* name() const noexcept override { return "RateLimitFilter"; }
+
+  Result OnIncomingRequest(const HttpConnection::Ptr& conn) override {
+    if (interval_ == 0) {
+      return Result::kPassed;
+    }
+    auto now = Now();
+    auto wait = Take(Find(Key(*conn), now), now);
+    if (wait == 0) {
+      return Result::kPassed;
+    }
+    rejected_.fetch_add(1, std::memory_order_relaxed);
+    // Rounded up, a client retrying then finds a token
+    auto seconds = (wait + kSecond - 1) / kSecond;
+    conn->RespondSerialized(seconds <= kCannedRetries
+                                ? canned_[seconds - 1]
+                                : TooManyRequests(seconds),
+                            conn->request().keep_alive());
+    return Result::kResponded;
+  }
+
+  // Tokens added per second. Set before ListenAndServe.
+  HttpRateLimitFilter& set_rate(double per_second) noexcept {
+    interval_ = 0;
+    if (per_second > 0) {
+      interval_ = std::max<std::uint64_t>(
+          static_cast<std::uint64_t>(kSecond / per_second), 1);
+    }
+    limit_ = interval_ * burst_;
+    return *this;
+  }
+
+  // Tokens a bucket holds. Set before ListenAndServe.
+  HttpRateLimitFilter& set_burst(std::uint64_t burst) noexcept {
+    burst_ = std::max<std::uint64_t>(burst, 1);
+    limit_ = interval_ * burst_;
+    return *this;
+  }
+
+  // is_valid runs on the io thread for every request carrying the header
+  HttpRateLimitFilter& set_key_header(
+      const std::string& key_header,
+      std::function<bool(std::string_view)> is_valid) {
+    key_header_ = key_header;
+    is_valid_ = std::move(is_valid);
+    return *this;
+  }
+
+  // Requests answered with 429 so far
+  std::uint64_t rejected() const noexcept {
+    return rejected_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  static constexpr std::uint64_t kSecond = 1000000000;
+  static constexpr std::uint64_t kCannedRetries = 60;
+  static constexpr std::size_t kShardSlots = 8;
+
+  struct Slot {
+    // 0 for an empty slot
+    std::atomic<std::uint64_t> key{0};
+    // When the bucket is full again, in ns since start_
+    std::atomic<std::uint64_t> full_at{0};
+  };
+
+  struct alignas(kShardSlots * sizeof(Slot)) Shard {
+    Slot slots[kShardSlots];
+  };
+
+  static std::shared_ptr<const std::string> TooManyRequests(
+      std::uint64_t seconds) {
+    return std::make_shared<const std::string>(
+        "HTTP/1.1 429 Too Many Requests\r\n"
+        "Content-Length: 0\r\n"
+        "Retry-After: " +
+        std::to_string(seconds) + "\r\n\r\n");
+  }
+
+  // splitmix64, never 0
+  static std::uint64_t Mix(std::uint64_t x) noexcept {
+    x += 0x9e3779b97f4a7c15;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    x ^= x >> 31;
+    return x == 0 ? 1 : x;
+  }
+
+  std::uint64_t Key(const HttpConnection& conn) const {
+    const auto& req = conn.request();
+    if (!key_header_.empty()) {
+      auto it = req.find(key_header_);
+      if (it != req.end()) {
+        std::string_view value{it->value().data(), it->value().size()};
+        if (is_valid_ && is_valid_(value)) {
+          // Odd, so that a key never hashes like an address
+          return Mix(std::hash<std::string_view>{}(value) | 1);
+        }
+      }
+    }
+    const auto& address = conn.remote_address();
+    if (address.is_v4()) {
+      return Mix(std::uint64_t{address.to_v4().to_uint()} << 1);
+    }
+    auto bytes = address.to_v6().to_bytes();
+    return Mix(std::hash<std::string_view>{}(std::string_view{
+                   reinterpret_cast<const char*>(bytes.data()), bytes.size()})
+               << 1);
+  }
+
+  std::uint64_t Now() const noexcept {
+    return static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start_)
+            .count());
+  }
+
+  Slot& Find(std::uint64_t key, std::uint64_t now) noexcept {
+    auto& shard = shards_[(key >> 32) & (shard_num_ - 1)];
+    for (;;) {
+      Slot* victim = nullptr;
+      std::uint64_t victim_key = 0;
+      std::uint64_t victim_full_at = UINT64_MAX;
+      for (auto& slot : shard.slots) {
+        auto slot_key = slot.key.load(std::memory_order_relaxed);
+        if (slot_key == key) {
+          return slot;
+        }
+        auto full_at = slot_key == 0
+                           ? 0
+                           : slot.full_at.load(std::memory_order_relaxed);
+        if (full_at < victim_full_at) {
+          victim = &slot;
+          victim_key = slot_key;
+          victim_full_at = full_at;
+        }
+      }
+      // The new key starts with a full bucket. Losing the race to another
+      // new key scans again.
+      if (victim->key.compare_exchange_strong(victim_key, key,
+                                              std::memory_order_relaxed)) {
+        if (victim_full_at > now) {
+          victim->full_at.store(0, std::memory_order_relaxed);
+        }
+        return *victim;
+      }
+    }
+  }
+
+  // 0 if a token was taken, else the ns until one is there
+  std::uint64_t Take(Slot& slot, std::uint64_t now) noexcept {
+    auto full_at = slot.full_at.load(std::memory_order_relaxed);
+    for (;;) {
+      auto next = std::max(full_at, now) + interval_;
+      if (next - now > limit_) {
+        return next - now - limit_;
+      }
+      if (slot.full_at.compare_exchange_weak(full_at, next,
+                                             std::memory_order_relaxed)) {
+        return 0;
+      }
+    }
+  }
+
+  std::size_t shard_num_;
+  std::unique_ptr<Shard[]> shards_;
+  std::chrono::steady_clock::time_point start_;
+  std::uint64_t interval_ = kSecond / 10;
+  std::uint64_t burst_ = 20;
+  std::uint64_t limit_ = kSecond / 10 * 20;
+  std::string key_header_;
+  std::function<bool(std::string_view)> is_valid_;
+  std::vector<std::shared_ptr<const std::string>> canned_;
+  std::atomic<std::uint64_t> rejected_{0};
+};
+
+}  // namespace pirest
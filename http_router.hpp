@@ -1,10 +1,13 @@
 #pragma once
-#include <boost/date_time.hpp>
-#include <boost/lexical_cast.hpp>
+#include <boost/container/small_vector.hpp>
 #include <boost/url/parse.hpp>
+#include <limits>
+#include <memory>
 #include <optional>
+#include <pirest/http_argument.hpp>
+#include <pirest/http_metrics.hpp>
 #include <pirest/http_utils.hpp>
-#include <regex>
+#include <pirest/http_worker_pool.hpp>
 #include <string_view>
 #include <tuple>
 #include <type_traits>
@@ -23,12 +26,45 @@ struct IsOptional<std::optional<T>> {
   static constexpr bool kValue = true;
 };
 
+enum class RouteError {
+  kNone,
+  kBadTarget,
+  kRouteNotFound,
+  kMethodNotAllowed,
+  kParameterMismatch,
+  kBadArgument,
+};
+
+static const char* RouteErrorMessage(RouteError error) noexcept {
+  switch (error) {
+    case RouteError::kNone:
+      return "";
+    case RouteError::kBadTarget:
+      return "Bad url target";
+    case RouteError::kRouteNotFound:
+      return "Route not found";
+    case RouteError::kMethodNotAllowed:
+      return "Method not allowed";
+    case RouteError::kParameterMismatch:
+      return "Parameter mismatch";
+    case RouteError::kBadArgument:
+      return "Bad argument";
+  }
+  return "Unknown route error";
+}
+
 template <class Ret, class... PreArgs>
 class HttpBasicRouter {
  public:
   using MethodList = std::vector<std::string>;
   using ParamList = std::vector<std::string>;
-  using ArgumentMap = std::unordered_map<std::string, std::string>;
+  using IndexList = std::vector<std::size_t>;
+  // Query argument of each param of a route, views into the encoded target
+  using ArgumentList =
+      boost::container::small_vector<std::optional<std::string_view>, 8>;
+  // Path arguments point into the request path, valid during the invocation
+  using PathArgs = boost::container::small_vector<std::string_view, 8>;
+  using SegmentList = boost::container::small_vector<std::string_view, 16>;
 
   template <class>
   struct FunctionTraits;
@@ -42,33 +78,44 @@ class HttpBasicRouter {
   };
 
   // traits for class method of const object
-  template <class ClsType, class... Args>
-  struct FunctionTraits<Ret (ClsType::*)(Args...) const>
-      : FunctionTraits<Ret (*)(Args...)> {
+  template <class R, class ClsType, class... Args>
+  struct FunctionTraits<R (ClsType::*)(Args...) const>
+      : FunctionTraits<R (*)(Args...)> {
     using ClassType = ClsType;
   };
 
   // traits for class method of non-const object
-  template <class ClsType, class... Args>
-  struct FunctionTraits<Ret (ClsType::*)(Args...)>
-      : FunctionTraits<Ret (*)(Args...)> {
+  template <class R, class ClsType, class... Args>
+  struct FunctionTraits<R (ClsType::*)(Args...)>
+      : FunctionTraits<R (*)(Args...)> {
     using ClassType = ClsType;
   };
 
   // for router invoke
-  template <class... Args>
-  struct FunctionTraits<Ret (*)(PreArgs&&..., Args...)>
-      : FunctionTraits<Ret (*)(Args...)> {
+  template <class R, class... Args>
+  struct FunctionTraits<R (*)(PreArgs&&..., Args...)>
+      : FunctionTraits<R (*)(Args...)> {
     using ClassType = void;
   };
 
+  // pre args taken by value, as coroutines must
+  template <class R, class... Args>
+  struct FunctionTraits<R (*)(std::decay_t<PreArgs>..., Args...)>
+      : FunctionTraits<R (*)(Args...)> {
+    using ClassType = void;
+    static constexpr bool kCopiesPreArgs = true;
+  };
+
   // final traits for argument size and value type
-  template <class... Args>
-  struct FunctionTraits<Ret (*)(Args...)> {
+  template <class R, class... Args>
+  struct FunctionTraits<R (*)(Args...)> {
     using ClassType = void;
+    using ResultType = R;
     template <std::size_t Index>
     using ValueType = std::tuple_element_t<Index, std::tuple<Args...>>;
     static constexpr std::size_t kArgNum = sizeof...(Args);
+    static constexpr bool kCopiesPreArgs = false;
+    static constexpr bool kReferenceArgs = (std::is_reference_v<Args> || ...);
   };
 
   class BaseBinder {
@@ -76,121 +123,139 @@ class HttpBasicRouter {
     virtual ~BaseBinder() noexcept = default;
 
     virtual bool IsMatched(std::size_t path_arg_num,
-                           const ArgumentMap& arg_map) const noexcept = 0;
+                           const ArgumentList& args) const noexcept = 0;
 
-    virtual Ret Invoke(PreArgs&&... pre_args, std::smatch& results,
-                       ArgumentMap& arg_map) = 0;
+    virtual Ret Invoke(PreArgs&&... pre_args, const PathArgs& path_args,
+                       const ArgumentList& args, RouteError& error) = 0;
   };
 
   template <class Function>
   class RouteBinder : public BaseBinder {
    public:
     using Traits = FunctionTraits<Function>;
+    using ObjectPtr = std::shared_ptr<typename Traits::ClassType>;
 
-    RouteBinder(std::size_t path_arg_num, ParamList capture_params,
-                Function&& func)
+    RouteBinder(std::size_t path_arg_num, IndexList param_indices,
+                Function&& func, ObjectPtr obj)
         : path_arg_num_{path_arg_num},
-          capture_params_{std::move(capture_params)},
-          func_{std::forward<Function>(func)} {
-      if (capture_params_.size() + path_arg_num_ != Traits::kArgNum) {
+          param_indices_{std::move(param_indices)},
+          func_{std::forward<Function>(func)},
+          obj_{std::move(obj)} {
+      if (param_indices_.size() + path_arg_num_ != Traits::kArgNum) {
         throw std::runtime_error("Number of parameters does not match");
       }
     }
 
     bool IsMatched(std::size_t path_arg_num,
-                   const ArgumentMap& arg_map) const noexcept override {
+                   const ArgumentList& args) const noexcept override {
       if (path_arg_num != path_arg_num_) {
         return false;
       }
-      return IsMatched<0>(arg_map);
+      return IsMatched<0>(args);
     }
 
     template <size_t N>
     std::enable_if_t<N != Traits::kArgNum, bool> IsMatched(
-        const ArgumentMap& arg_map) const noexcept {
+        const ArgumentList& args) const noexcept {
       if (path_arg_num_ > N) {
-        return IsMatched<N + 1>(arg_map);
+        return IsMatched<N + 1>(args);
       }
       using ValueType = std::remove_cv_t<
           std::remove_reference_t<typename Traits::template ValueType<N>>>;
       if constexpr (!IsOptional<ValueType>::kValue) {
-        if (!arg_map.contains(capture_params_[N - path_arg_num_])) {
+        if (!args[param_indices_[N - path_arg_num_]]) {
           return false;
         }
       }
-      return IsMatched<N + 1>(arg_map);
+      return IsMatched<N + 1>(args);
     }
 
     template <size_t N>
     std::enable_if_t<N == Traits::kArgNum, bool> IsMatched(
-        const ArgumentMap&) const noexcept {
+        const ArgumentList&) const noexcept {
       return true;
     }
 
-    Ret Invoke(PreArgs&&... pre_args, std::smatch& results,
-               ArgumentMap& arg_map) override {
-      return DoInvoke(std::forward<PreArgs>(pre_args)..., results, arg_map);
+    Ret Invoke(PreArgs&&... pre_args, const PathArgs& path_args,
+               const ArgumentList& args, RouteError& error) override {
+      return DoInvoke(std::forward<PreArgs>(pre_args)..., path_args, args,
+                      error);
     }
 
     template <class Value>
-    static void SetValue(Value& val, std::string&& str) {
-      if constexpr (std::is_same_v<std::string, Value>) {
-        val = std::move(str);
-      } else if constexpr (std::is_same_v<boost::gregorian::date, Value>) {
-        val = boost::gregorian::from_simple_string(str);
-      } else if constexpr (std::is_same_v<boost::posix_time::ptime, Value>) {
-        val = boost::posix_time::from_iso_extended_string(str);
-      } else {
-        val = boost::lexical_cast<Value>(str);
-      }
+    static bool SetValue(Value& val, std::string_view str) {
+      return ArgumentParser<Value>::Parse(str, val);
     }
 
     template <class Value>
-    static void SetValue(std::optional<Value>& val, std::string&& str) {
-      if constexpr (std::is_same_v<std::string, Value>) {
-        val = std::make_optional<Value>(std::move(str));
-      } else if constexpr (std::is_same_v<boost::gregorian::date, Value>) {
-        val = std::make_optional<Value>(
-            boost::gregorian::from_simple_string(str));
-      } else if constexpr (std::is_same_v<boost::posix_time::ptime, Value>) {
-        val = std::make_optional<Value>(
-            boost::posix_time::from_iso_extended_string(str));
-      } else {
-        val = std::make_optional<Value>(boost::lexical_cast<Value>(str));
+    static bool SetValue(std::optional<Value>& val, std::string_view str) {
+      Value value;
+      if (!ArgumentParser<Value>::Parse(str, value)) {
+        return false;
       }
+      val = std::move(value);
+      return true;
     }
 
     template <class... Values>
     std::enable_if_t<sizeof...(Values) < Traits::kArgNum, Ret> DoInvoke(
-        PreArgs&&... pre_args, std::smatch& results, ArgumentMap& arg_map,
-        Values&&... values) {
+        PreArgs&&... pre_args, const PathArgs& path_args,
+        const ArgumentList& args, RouteError& error, Values&&... values) {
       constexpr auto index = sizeof...(Values);
       using ValueType = std::remove_cv_t<
           std::remove_reference_t<typename Traits::template ValueType<index>>>;
       ValueType value;
+      bool ok = true;
       if (path_arg_num_ > index) {
-        SetValue(value, results[index + 1].str());
+        ok = SetValue(value, path_args[index]);
       } else {
-        auto it = arg_map.find(capture_params_[index - path_arg_num_]);
+        const auto& arg = args[param_indices_[index - path_arg_num_]];
+        std::string buffer;
         if constexpr (IsOptional<ValueType>::kValue) {
-          if (it != arg_map.end()) {
-            SetValue(value, std::move(it->second));
+          if (arg) {
+            ok = SetValue(value, DecodeQuery(*arg, buffer));
           }
         } else {
-          assert(it != arg_map.end());
-          SetValue(value, std::move(it->second));
+          assert(arg);
+          ok = SetValue(value, DecodeQuery(*arg, buffer));
         }
       }
-      return DoInvoke(std::forward<PreArgs>(pre_args)..., results, arg_map,
-                      std::forward<Values>(values)..., std::move(value));
+      if (!ok) {
+        error = RouteError::kBadArgument;
+        return Ret{};
+      }
+      return DoInvoke(std::forward<PreArgs>(pre_args)..., path_args, args,
+                      error, std::forward<Values>(values)..., std::move(value));
     }
 
     template <class... Values>
     std::enable_if_t<sizeof...(Values) == Traits::kArgNum, Ret> DoInvoke(
-        PreArgs&&... pre_args, std::smatch&, ArgumentMap&, Values&&... values) {
-      if constexpr (std::is_same_v<typename Traits::ClassType, void>) {
+        PreArgs&&... pre_args, const PathArgs&, const ArgumentList&,
+        RouteError&, Values&&... values) {
+      using ClassType = typename Traits::ClassType;
+      if constexpr (!std::is_same_v<typename Traits::ResultType, Ret>) {
+        // A coroutine, SpawnRouteHandler is found through PreArgs and
+        // keeps obj alive until the coroutine finishes
+        static_assert((std::is_lvalue_reference_v<PreArgs> && ...));
+        static_assert(Traits::kCopiesPreArgs && !Traits::kReferenceArgs,
+                      "A coroutine handler takes its arguments by value, "
+                      "references would dangle once it suspends");
+        if constexpr (std::is_void_v<ClassType>) {
+          SpawnRouteHandler(pre_args...,
+                            func_(pre_args..., std::move(values)...),
+                            std::shared_ptr<void>{});
+        } else {
+          auto obj = obj_ ? obj_ : std::make_shared<ClassType>();
+          auto coroutine = (*obj.*func_)(pre_args..., std::move(values)...);
+          SpawnRouteHandler(pre_args..., std::move(coroutine), std::move(obj));
+        }
+        return Ret{};
+      } else if constexpr (std::is_same_v<ClassType, void>) {
         return func_(std::forward<PreArgs>(pre_args)...,
                      std::forward<Values>(values)...);
+      } else if (obj_) {
+        return (*obj_.*func_)(std::forward<PreArgs>(pre_args)...,
+                              std::forward<Values>(values)...);
       } else {
         auto obj = std::make_shared<typename Traits::ClassType>();
         return (*obj.*func_)(std::forward<PreArgs>(pre_args)...,
@@ -200,30 +265,33 @@ class HttpBasicRouter {
 
    private:
     std::size_t path_arg_num_;
-    ParamList capture_params_;
+    IndexList param_indices_;
     Function func_;
+    ObjectPtr obj_;
   };
 
   class RouteItem {
    public:
     using BinderList = std::vector<std::shared_ptr<BaseBinder>>;
 
-    RouteItem() noexcept = default;
-
-    explicit RouteItem(const std::string& regex_path) noexcept
-        : regex_path_{regex_path} {
-      regex_ = std::regex{regex_path, std::regex_constants::icase};
-    }
-
-    const std::regex& regex() const noexcept { return regex_; }
-
-    const std::string& regex_path() const noexcept { return regex_path_; }
-
     template <class Function>
-    void AddHandleFunc(std::size_t path_arg_num, MethodList allowed_methods,
-                       ParamList capture_params, Function&& func) {
+    void AddHandleFunc(
+        std::size_t path_arg_num, MethodList allowed_methods,
+        const ParamList& capture_params, Function&& func,
+        typename RouteBinder<Function>::ObjectPtr obj) {
+      // Binders refer to params by index into the params of the whole route,
+      // so the query string is scanned once per request for all binders.
+      IndexList param_indices;
+      for (const auto& param : capture_params) {
+        auto it = std::find(param_names_.begin(), param_names_.end(), param);
+        param_indices.emplace_back(it - param_names_.begin());
+        if (it == param_names_.end()) {
+          param_names_.emplace_back(param);
+        }
+      }
       auto binder = std::make_shared<RouteBinder<Function>>(
-          path_arg_num, capture_params, std::forward<Function>(func));
+          path_arg_num, std::move(param_indices), std::forward<Function>(func),
+          std::move(obj));
       for (const auto& method : allowed_methods) {
         auto it = allowed_method_binders_.find(method);
         if (it == allowed_method_binders_.end()) {
@@ -241,33 +309,410 @@ class HttpBasicRouter {
       return allowed_method_binders_.contains(method);
     }
 
+    // The handlers read the request body themselves instead of getting it
+    // buffered in the request.
+    bool stream_body() const noexcept { return stream_body_; }
+
+    void set_stream_body(bool stream_body) noexcept {
+      stream_body_ = stream_body;
+    }
+
+    // Where the handlers run, null for the io thread
+    const std::shared_ptr<HttpWorkerPool>& worker_pool() const noexcept {
+      return worker_pool_;
+    }
+
+    void set_worker_pool(std::shared_ptr<HttpWorkerPool> pool) noexcept {
+      worker_pool_ = std::move(pool);
+    }
+
+    // The path the route was added with, e.g. "/users/{}"
+    const std::string& pattern() const noexcept { return pattern_; }
+
+    void set_pattern(const std::string& pattern) { pattern_ = pattern; }
+
+    HttpRouteMetrics& metrics() noexcept { return metrics_; }
+
+    const HttpRouteMetrics& metrics() const noexcept { return metrics_; }
+
     Ret Invoke(PreArgs&&... pre_args, const std::string& method,
-               std::smatch& results, ArgumentMap&& arg_map) {
-      std::size_t path_arg_num = 0;
-      if (results.size() > 1) {
-        path_arg_num = results.size() - 1;
-      }
+               const PathArgs& path_args, std::string_view query,
+               RouteError& error) {
       auto it = allowed_method_binders_.find(method);
       assert(it != allowed_method_binders_.end());
+      ArgumentList args(param_names_.size());
+      BindArguments(query, args);
       for (const auto& binder : it->second) {
-        if (binder->IsMatched(path_arg_num, arg_map)) {
-          return binder->Invoke(std::forward<PreArgs>(pre_args)..., results,
-                                arg_map);
+        if (binder->IsMatched(path_args.size(), args)) {
+          return binder->Invoke(std::forward<PreArgs>(pre_args)..., path_args,
+                                args, error);
         }
       }
-      throw std::runtime_error("Parameter mismatch");
+      error = RouteError::kParameterMismatch;
       return Ret{};
     }
 
    private:
-    std::regex regex_;
-    std::string regex_path_;
+    // Keys are compared case-insensitively, the first occurrence wins
+    void BindArguments(std::string_view query,
+                       ArgumentList& args) const noexcept {
+      while (!query.empty()) {
+        auto param = query.substr(0, query.find('&'));
+        query.remove_prefix(std::min(param.size() + 1, query.size()));
+        auto pos = param.find('=');
+        auto key = param.substr(0, pos);
+        auto value = pos == param.npos ? param.substr(param.size())
+                                       : param.substr(pos + 1);
+        for (std::size_t i = 0; i < param_names_.size(); ++i) {
+          if (!args[i] && IEqualsQuery(key, param_names_[i])) {
+            args[i] = value;
+            break;
+          }
+        }
+      }
+    }
+
+   private:
+    ParamList param_names_;
     std::unordered_map<std::string, BinderList> allowed_method_binders_;
+    bool stream_body_ = false;
+    std::shared_ptr<HttpWorkerPool> worker_pool_;
+    std::string pattern_;
+    HttpRouteMetrics metrics_;
+  };
+
+  // Literal pieces of a path segment around its "{}" captures, e.g. "{}" is
+  // {"", ""} and "v{}.{}" is {"v", ".", ""}. Matching is case-insensitive and
+  // every capture is greedy, the same as the "([^/]*)" regex it replaces.
+  using SegmentPattern = std::vector<std::string>;
+
+  static SegmentPattern ParseSegment(std::string_view segment) {
+    SegmentPattern pattern{std::string{}};
+    while (!segment.empty()) {
+      auto begin = segment.find('{');
+      auto end = segment.find('}', begin);
+      if (begin == segment.npos || end == segment.npos) {
+        pattern.back().append(segment);
+        break;
+      }
+      pattern.back().append(segment.substr(0, begin));
+      pattern.emplace_back();
+      segment.remove_prefix(end + 1);
+    }
+    return pattern;
+  }
+
+  static bool MatchSegment(std::string_view segment, const std::string* literal,
+                           std::size_t capture_num, PathArgs& path_args) {
+    if (!IStartsWith(segment, *literal)) {
+      return false;
+    }
+    segment.remove_prefix(literal->size());
+    if (capture_num == 0) {
+      return segment.empty();
+    }
+    for (auto len = segment.size() + 1; len-- > 0;) {
+      path_args.emplace_back(segment.substr(0, len));
+      if (MatchSegment(segment.substr(len), literal + 1, capture_num - 1,
+                       path_args)) {
+        return true;
+      }
+      path_args.pop_back();
+    }
+    return false;
+  }
+
+  // Trie of parameterized routes, one level per path segment. Static segments
+  // are looked up by hash, capture segments are tried in turn, a trailing
+  // "{*}" captures the rest of the path with its slashes. Several routes
+  // may match a path, the earliest added one wins as it did with the linear
+  // regex scan, min_order_ lets the search skip subtrees that cannot win.
+  class RouteNode {
+   public:
+    struct Match {
+      PathArgs path_args;
+      PathArgs best_args;
+      RouteItem* item = nullptr;
+      std::size_t order = std::numeric_limits<std::size_t>::max();
+    };
+
+    RouteNode* AddChild(std::string_view segment) {
+      if (segment == "{*}") {
+        if (!rest_child_) {
+          rest_child_ = std::make_unique<RouteNode>();
+        }
+        return rest_child_.get();
+      }
+      auto pattern = ParseSegment(segment);
+      if (pattern.size() == 1) {
+        auto it = static_children_.find(segment);
+        if (it == static_children_.end()) {
+          it = static_children_
+                   .emplace(std::string{segment}, std::make_unique<RouteNode>())
+                   .first;
+        }
+        return it->second.get();
+      }
+      for (auto& child : pattern_children_) {
+        if (child.first == pattern) {
+          return child.second.get();
+        }
+      }
+      pattern_children_.emplace_back(std::move(pattern),
+                                     std::make_unique<RouteNode>());
+      return pattern_children_.back().second.get();
+    }
+
+    RouteItem* item() const noexcept { return item_.get(); }
+
+    template <class Visitor>
+    void ForEachItem(Visitor& visitor) const {
+      if (item_) {
+        visitor(static_cast<const RouteItem&>(*item_));
+      }
+      for (const auto& child : static_children_) {
+        child.second->ForEachItem(visitor);
+      }
+      for (const auto& child : pattern_children_) {
+        child.second->ForEachItem(visitor);
+      }
+      if (rest_child_) {
+        rest_child_->ForEachItem(visitor);
+      }
+    }
+
+    void set_item(std::unique_ptr<RouteItem> item, std::size_t order) noexcept {
+      item_ = std::move(item);
+      order_ = order;
+    }
+
+    void UpdateMinOrder(std::size_t order) noexcept {
+      min_order_ = std::min(min_order_, order);
+    }
+
+    void Find(const SegmentList& segments, std::size_t index,
+              Match& match) const {
+      if (min_order_ >= match.order) {
+        return;
+      }
+      if (index == segments.size()) {
+        if (item_ && order_ < match.order) {
+          match.item = item_.get();
+          match.order = order_;
+          match.best_args = match.path_args;
+        }
+        return;
+      }
+      auto segment = segments[index];
+      auto it = static_children_.find(segment);
+      if (it != static_children_.end()) {
+        it->second->Find(segments, index + 1, match);
+      }
+      for (const auto& child : pattern_children_) {
+        auto size = match.path_args.size();
+        if (MatchSegment(segment, child.first.data(), child.first.size() - 1,
+                         match.path_args)) {
+          child.second->Find(segments, index + 1, match);
+        }
+        match.path_args.resize(size);
+      }
+      if (rest_child_) {
+        const auto& last = segments.back();
+        match.path_args.emplace_back(
+            segment.data(),
+            static_cast<std::size_t>(last.data() + last.size() -
+                                     segment.data()));
+        rest_child_->Find(segments, segments.size(), match);
+        match.path_args.pop_back();
+      }
+    }
+
+   private:
+    std::unordered_map<std::string, std::unique_ptr<RouteNode>, IHash, IEqual>
+        static_children_;
+    std::vector<std::pair<SegmentPattern, std::unique_ptr<RouteNode>>>
+        pattern_children_;
+    std::unique_ptr<RouteNode> rest_child_;
+    std::unique_ptr<RouteItem> item_;
+    std::size_t order_ = std::numeric_limits<std::size_t>::max();
+    std::size_t min_order_ = std::numeric_limits<std::size_t>::max();
   };
 
+  static SegmentList SplitPath(std::string_view path) {
+    SegmentList segments;
+    if (!path.empty() && path.front() == '/') {
+      path.remove_prefix(1);
+    }
+    while (true) {
+      auto pos = path.find('/');
+      segments.emplace_back(path.substr(0, pos));
+      if (pos == path.npos) {
+        break;
+      }
+      path.remove_prefix(pos + 1);
+    }
+    return segments;
+  }
+
   template <class Function>
   void AddRoute(const std::string& target, Function&& func,
                 MethodList allowed_methods) {
+    DoAddRoute(target, std::forward<Function>(func), nullptr,
+               std::move(allowed_methods));
+  }
+
+  // Every handler of the route streams the request body, see IsStreamBody
+  template <class Function>
+  void AddStreamRoute(const std::string& target, Function&& func,
+                      MethodList allowed_methods) {
+    DoAddRoute(target, std::forward<Function>(func), nullptr,
+               std::move(allowed_methods))
+        .set_stream_body(true);
+    ++stream_route_num_;
+  }
+
+  // Every handler of the route runs on pool, see FindWorkerPool
+  template <class Function>
+  void AddBlockingRoute(const std::string& target,
+                        std::shared_ptr<HttpWorkerPool> pool, Function&& func,
+                        MethodList allowed_methods) {
+    DoAddRoute(target, std::forward<Function>(func), nullptr,
+               std::move(allowed_methods))
+        .set_worker_pool(std::move(pool));
+    ++blocking_route_num_;
+  }
+
+  // Member function called on obj, instead of on a new object per request.
+  // obj is shared by every io thread.
+  template <class Class, class Function>
+  void AddRoute(const std::string& target, std::shared_ptr<Class> obj,
+                Function&& func, MethodList allowed_methods) {
+    static_assert(
+        !std::is_void_v<typename FunctionTraits<Function>::ClassType>,
+        "Only a member function can be bound to an object");
+    DoAddRoute(target, std::forward<Function>(func), std::move(obj),
+               std::move(allowed_methods));
+  }
+
+  // As above, obj is not owned and must outlive the router
+  template <class Class, class Function>
+  void AddRoute(const std::string& target, Class* obj, Function&& func,
+                MethodList allowed_methods) {
+    AddRoute(target, std::shared_ptr<Class>{std::shared_ptr<Class>{}, obj},
+             std::forward<Function>(func), std::move(allowed_methods));
+  }
+
+  RouteItem* FindRoute(std::string_view path, PathArgs& path_args) {
+    auto it = route_map_.find(path);
+    if (it != route_map_.end()) {
+      return &it->second;
+    }
+    typename RouteNode::Match match;
+    route_tree_.Find(SplitPath(path), 0, match);
+    path_args = std::move(match.best_args);
+    return match.item;
+  }
+
+  // Whether the route of target was added with AddStreamRoute, checked before
+  // the request body is read.
+  bool IsStreamBody(std::string_view target) {
+    if (stream_route_num_ == 0) {
+      return false;
+    }
+    auto route = FindTarget(target);
+    return route && route->stream_body();
+  }
+
+  // The pool of the route of target if it was added with AddBlockingRoute.
+  // The caller routes the request on it, the handler isn't invoked here.
+  HttpWorkerPool* FindWorkerPool(std::string_view target) {
+    if (blocking_route_num_ == 0) {
+      return nullptr;
+    }
+    auto route = FindTarget(target);
+    return route ? route->worker_pool().get() : nullptr;
+  }
+
+  Ret Routing(PreArgs&&... pre_args, const std::string& method,
+              std::string_view target) {
+    RouteError error = RouteError::kNone;
+    if constexpr (std::is_void_v<Ret>) {
+      Routing(std::forward<PreArgs>(pre_args)..., method, target, error);
+      if (error != RouteError::kNone) {
+        throw std::runtime_error(RouteErrorMessage(error));
+      }
+    } else {
+      auto ret =
+          Routing(std::forward<PreArgs>(pre_args)..., method, target, error);
+      if (error != RouteError::kNone) {
+        throw std::runtime_error(RouteErrorMessage(error));
+      }
+      return ret;
+    }
+  }
+
+  // Calls visitor(const RouteItem&) for every route
+  template <class Visitor>
+  void ForEachRoute(Visitor&& visitor) const {
+    for (const auto& pair : route_map_) {
+      visitor(pair.second);
+    }
+    route_tree_.ForEachItem(visitor);
+  }
+
+  // Reports routing failures through error instead of throwing, exceptions
+  // thrown by the handler itself still propagate. matched, if given, is set
+  // to the route before its handler is invoked.
+  Ret Routing(PreArgs&&... pre_args, const std::string& method,
+              std::string_view target, RouteError& error,
+              RouteItem** matched = nullptr) {
+    error = RouteError::kNone;
+    auto r = boost::urls::parse_origin_form(target);
+    if (r.has_error()) {
+      error = RouteError::kBadTarget;
+      return Ret{};
+    }
+    auto& v = r.value();
+    auto encoded_path = v.encoded_path();
+    std::string buffer;
+    auto path = DecodePath(
+        std::string_view{encoded_path.data(), encoded_path.size()}, buffer);
+    PathArgs path_args;
+    auto route = FindRoute(path, path_args);
+    if (!route) {
+      error = RouteError::kRouteNotFound;
+      return Ret{};
+    }
+    if (!route->IsAllowedMethod(method)) {
+      error = RouteError::kMethodNotAllowed;
+      return Ret{};
+    }
+    if (matched) {
+      *matched = route;
+    }
+    auto query = v.encoded_query();
+    return route->Invoke(std::forward<PreArgs>(pre_args)..., method, path_args,
+                         std::string_view{query.data(), query.size()}, error);
+  }
+
+ private:
+  RouteItem* FindTarget(std::string_view target) {
+    auto r = boost::urls::parse_origin_form(target);
+    if (r.has_error()) {
+      return nullptr;
+    }
+    auto encoded_path = r.value().encoded_path();
+    std::string buffer;
+    auto path = DecodePath(
+        std::string_view{encoded_path.data(), encoded_path.size()}, buffer);
+    PathArgs path_args;
+    return FindRoute(path, path_args);
+  }
+
+  template <class Function>
+  RouteItem& DoAddRoute(const std::string& target, Function&& func,
+                        typename RouteBinder<Function>::ObjectPtr obj,
+                        MethodList allowed_methods) {
     std::string path;
     ParamList capture_params;
     auto pos = target.find('?');
@@ -286,98 +731,51 @@ class HttpBasicRouter {
       path = target;
     }
 
-    std::regex regex("\\{([^/]*)\\}");
-
     std::size_t path_arg_num = 0;
-    {
-      std::smatch results;
-      std::string temp_path = path;
-      while (std::regex_search(temp_path, results, regex)) {
-        ++path_arg_num;
-        temp_path = results.suffix();
+    auto segments = SplitPath(path);
+    for (auto segment : segments) {
+      if (segment == "{*}" && segment.data() != segments.back().data()) {
+        throw std::runtime_error("{*} must be the last segment");
       }
+      path_arg_num += ParseSegment(segment).size() - 1;
     }
 
-    auto replaced_path = std::regex_replace(path, regex, "([^/]*)");
     RouteItem* item_ptr = nullptr;
-    bool is_regex = (replaced_path != path);
-    if (is_regex) {
-      for (auto& item : route_vec_) {
-        if (item.regex_path() == replaced_path) {
-          item_ptr = &item;
-          break;
+    if (path_arg_num > 0) {
+      std::vector<RouteNode*> nodes{&route_tree_};
+      for (auto segment : segments) {
+        nodes.emplace_back(nodes.back()->AddChild(segment));
+      }
+      item_ptr = nodes.back()->item();
+      if (!item_ptr) {
+        auto order = route_num_++;
+        nodes.back()->set_item(std::make_unique<RouteItem>(), order);
+        for (auto node : nodes) {
+          node->UpdateMinOrder(order);
         }
+        item_ptr = nodes.back()->item();
       }
     } else {
-      auto it = route_map_.find(path);
-      if (it != route_map_.end()) item_ptr = &it->second;
-    }
-
-    if (!item_ptr) {
-      if (is_regex) {
-        RouteItem item{replaced_path};
-        route_vec_.emplace_back(std::move(item));
-        item_ptr = &route_vec_.back();
-      } else {
-        RouteItem item;
-        route_map_[path] = std::move(item);
-        item_ptr = &route_map_[path];
-      }
+      item_ptr = &route_map_[path];
     }
 
     for (auto& method : allowed_methods) {
       ToUpper(method);
     }
 
+    item_ptr->set_pattern(path);
     item_ptr->AddHandleFunc(path_arg_num, allowed_methods, capture_params,
-                            std::forward<Function>(func));
-  }
-
-  RouteItem* FindRoute(const std::string& path, std::smatch& results) noexcept {
-    RouteItem* item_ptr = nullptr;
-    auto it = route_map_.find(path);
-    if (it != route_map_.end()) {
-      item_ptr = &it->second;
-    } else {
-      for (auto& item : route_vec_) {
-        if (std::regex_match(path, results, item.regex())) {
-          item_ptr = &item;
-          break;
-        }
-      }
-    }
-    return item_ptr;
-  }
-
-  Ret Routing(PreArgs&&... pre_args, const std::string& method,
-              std::string_view target) {
-    auto r = boost::urls::parse_origin_form(target);
-    if (r.has_error()) {
-      throw std::runtime_error("Bad url target");
-    }
-    auto& v = r.value();
-    auto path = v.path();
-    std::smatch results;
-    auto route = FindRoute(path, results);
-    if (!route) {
-      throw std::runtime_error("Route not found");
-    }
-    if (!route->IsAllowedMethod(method)) {
-      throw std::runtime_error("Method not allowed");
-    }
-    ArgumentMap arg_map;
-    for (auto param : v.params()) {
-      ToLower(param.key);
-      arg_map.insert(
-          std::make_pair(std::move(param.key), std::move(param.value)));
-    }
-    return route->Invoke(std::forward<PreArgs>(pre_args)..., method, results,
-                         std::move(arg_map));
+                            std::forward<Function>(func), std::move(obj));
+    return *item_ptr;
   }
 
  private:
-  std::vector<RouteItem> route_vec_;
-  std::unordered_map<std::string, RouteItem> route_map_;
+  RouteNode route_tree_;
+  std::size_t route_num_ = 0;
+  std::size_t stream_route_num_ = 0;
+  std::size_t blocking_route_num_ = 0;
+  std::unordered_map<std::string, RouteItem, StringHash, std::equal_to<>>
+      route_map_;
 };
 
 class HttpConnection;
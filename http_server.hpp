@@ -1,15 +1,27 @@
 #pragma once
+#include <algorithm>
+#include <atomic>
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/ssl/context.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <pirest/http_connection_impl.hpp>
 #include <pirest/http_router.hpp>
+#include <pirest/http_tls.hpp>
+#include <thread>
 
 namespace pirest {
 
+#ifdef SO_REUSEPORT
+using ReusePort =
+    boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+#endif
+
 class SingleThreadIo {
  public:
   void Run() {
+    ctx_.restart();
+    guard_.emplace(ctx_.get_executor());
     thread_ = std::thread([this]() { ctx_.run(); });
   }
 
@@ -24,66 +36,270 @@ class SingleThreadIo {
 
   boost::asio::io_context& ctx() noexcept { return ctx_; }
 
+  // Destroys the pending handlers, the context can't run again
+  void Shutdown() { ctx_.shutdown(); }
+
  private:
+  struct Context : boost::asio::io_context {
+    using boost::asio::io_context::io_context;
+    using boost::asio::execution_context::shutdown;
+  };
+
   std::thread thread_;
-  boost::asio::io_context ctx_{1};
-  boost::asio::executor_work_guard<boost::asio::io_context::executor_type>
-      guard_ = boost::asio::make_work_guard(ctx_);
+  Context ctx_{1};
+  std::optional<
+      boost::asio::executor_work_guard<boost::asio::io_context::executor_type>>
+      guard_;
+};
+
+// N single threaded io_contexts, connections are assigned round-robin.
+// The contexts live as long as the pool so that sockets created on them
+// (including the peer socket of a pending accept) never outlive their context.
+class IoContextPool {
+ public:
+  void Run(std::size_t size) {
+    size = std::max<std::size_t>(size, 1);
+    while (ios_.size() < size) {
+      ios_.emplace_back(std::make_unique<SingleThreadIo>());
+    }
+    for (std::size_t i = 0; i < size; ++i) {
+      ios_[i]->Run();
+    }
+    running_ = size;
+    next_.store(0, std::memory_order_relaxed);
+  }
+
+  void Close() {
+    for (std::size_t i = 0; i < running_; ++i) {
+      ios_[i]->Close();
+    }
+    running_ = 0;
+  }
+
+  void Shutdown() {
+    for (auto& io : ios_) {
+      io->Shutdown();
+    }
+  }
+
+  std::size_t size() const noexcept { return running_; }
+
+  boost::asio::io_context& ctx(std::size_t index) noexcept {
+    return ios_[index]->ctx();
+  }
+
+  // Safe to call from several threads
+  boost::asio::io_context& NextCtx() noexcept {
+    return ios_[next_.fetch_add(1, std::memory_order_relaxed) % running_]
+        ->ctx();
+  }
+
+ private:
+  std::vector<std::unique_ptr<SingleThreadIo>> ios_;
+  std::size_t running_ = 0;
+  std::atomic<std::size_t> next_{0};
 };
 
 template <class CONNECTION>
 class HttpBasicServer {
  public:
-  HttpBasicServer() noexcept
-      : acceptor_{accept_io_.ctx()}, socket_{socket_io_.ctx()} {}
+  HttpBasicServer() noexcept : acceptor_{accept_io_.ctx()} {}
 
-  ~HttpBasicServer() noexcept { Close(); }
+  ~HttpBasicServer() noexcept {
+    Close();
+    // Its handlers hold connections whose sockets belong to socket_io_
+    handshake_io_.Shutdown();
+  }
 
   HttpSetting& setting() noexcept { return setting_; }
 
+  // func may be a coroutine returning boost::asio::awaitable<void>, it runs
+  // on the io thread of the connection and takes its arguments by value.
   template <class Function>
   void HandleFunc(const std::string& target, Function&& func,
                   const std::vector<std::string>& allowed_methods = {}) {
     router_.AddRoute(target, std::forward<Function>(func), allowed_methods);
   }
 
+  // Member function called on obj, which is shared by every io thread
+  template <class Class, class Function>
+  void HandleFunc(const std::string& target, const std::shared_ptr<Class>& obj,
+                  Function&& func,
+                  const std::vector<std::string>& allowed_methods = {}) {
+    router_.AddRoute(target, obj, std::forward<Function>(func),
+                     allowed_methods);
+  }
+
+  // As above, obj is not owned and must outlive the server
+  template <class Class, class Function>
+  void HandleFunc(const std::string& target, Class* obj, Function&& func,
+                  const std::vector<std::string>& allowed_methods = {}) {
+    router_.AddRoute(target, obj, std::forward<Function>(func),
+                     allowed_methods);
+  }
+
+  // The handlers get request() without a body and pull it themselves with
+  // HttpConnection::ReadBody, body_limit doesn't apply.
+  template <class Function>
+  void HandleStream(const std::string& target, Function&& func,
+                    const std::vector<std::string>& allowed_methods = {}) {
+    router_.AddStreamRoute(target, std::forward<Function>(func),
+                           allowed_methods);
+  }
+
+  // The handlers run on pool instead of the io thread, and may block.
+  // Requests that find its queue full get 503. Responding from the pool is
+  // safe, the write is handed to the io thread. Close and the destructor
+  // wait for the tasks the server posted to pool, so they mustn't be called
+  // from its handlers.
+  template <class Function>
+  void HandleBlocking(const std::string& target,
+                      const std::shared_ptr<HttpWorkerPool>& pool,
+                      Function&& func,
+                      const std::vector<std::string>& allowed_methods = {}) {
+    router_.AddBlockingRoute(target, pool, std::forward<Function>(func),
+                             allowed_methods);
+    if (std::find(worker_pools_.begin(), worker_pools_.end(), pool) ==
+        worker_pools_.end()) {
+      worker_pools_.emplace_back(pool);
+    }
+  }
+
+  // Serves the metrics in the Prometheus text format on GET target, creating
+  // them if the setting has none. Call it before ListenAndServe.
+  void HandleMetrics(const std::string& target) {
+    if (!setting_.metrics) {
+      setting_.metrics = std::make_shared<HttpMetrics>();
+    }
+    router_.AddRoute(
+        target,
+        [this, metrics = setting_.metrics](const HttpConnection::Ptr& conn) {
+          std::string out;
+          metrics->Export(out, [this](auto&& visitor) {
+            router_.ForEachRoute([&visitor](const auto& item) {
+              visitor(item.pattern(), item.metrics());
+            });
+          });
+          conn->Respond(boost::beast::http::status::ok, std::move(out),
+                        "text/plain; version=0.0.4");
+        },
+        {"GET"});
+  }
+
+  // Certificate, protocol versions and session resumption of https
+  // connections. Call it before ListenAndServe.
+  void ConfigureTls(const HttpTlsSetting& tls) {
+    tls_setting_ = tls;
+    tls_setting_.Apply(ssl_ctx_);
+  }
+
+  // For what HttpTlsSetting doesn't cover, e.g. client certificates or ALPN
+  boost::asio::ssl::context& ssl_context() noexcept { return ssl_ctx_; }
+
   void ListenAndServe(const std::string& address, std::uint16_t port) {
     boost::asio::ip::tcp::endpoint endpoint{
         boost::asio::ip::make_address(address), port};
+    if (setting_.reuse_port) {
+      return ListenAndServeSharded(endpoint);
+    }
     acceptor_.open(endpoint.protocol());
     acceptor_.set_option(boost::asio::socket_base::reuse_address(true));
     acceptor_.bind(endpoint);
     acceptor_.listen();
+    closed_ = false;
     accept_io_.Run();
-    socket_io_.Run();
+    socket_io_.Run(setting_.io_threads);
+    RunHandshakeIo();
     StartAccept();
   }
 
   void Close() noexcept {
     closed_ = true;
+    ++epoch_;
     boost::system::error_code ec;
     acceptor_.cancel(ec);
     acceptor_.close(ec);
+    for (auto& acceptor : shard_acceptors_) {
+      acceptor.cancel(ec);
+      acceptor.close(ec);
+    }
     accept_io_.Close();
     socket_io_.Close();
+    handshake_io_.Close();
+    // No io thread posts any more, the tasks still hold connections
+    for (const auto& pool : worker_pools_) {
+      pool->Drain();
+    }
     acceptor_ = boost::asio::ip::tcp::acceptor{accept_io_.ctx()};
+    shard_acceptors_.clear();
   }
 
   boost::asio::ip::tcp::endpoint local_endpoint() const {
+    if (!shard_acceptors_.empty()) {
+      return shard_acceptors_.front().local_endpoint();
+    }
     return acceptor_.local_endpoint();
   }
 
  private:
+  // Every io thread owns an acceptor bound to the same endpoint, the kernel
+  // spreads incoming connections over them and a connection never leaves the
+  // thread that accepted it.
+  void ListenAndServeSharded(boost::asio::ip::tcp::endpoint endpoint) {
+#ifdef SO_REUSEPORT
+    auto size = std::max<std::size_t>(setting_.io_threads, 1);
+    shard_acceptors_.reserve(size);
+    socket_io_.Run(size);
+    try {
+      for (std::size_t i = 0; i < size; ++i) {
+        auto& acceptor = shard_acceptors_.emplace_back(socket_io_.ctx(i));
+        acceptor.open(endpoint.protocol());
+        acceptor.set_option(boost::asio::socket_base::reuse_address(true));
+        acceptor.set_option(ReusePort(true));
+        acceptor.bind(endpoint);
+        acceptor.listen();
+        // The first bind resolves port 0, the others must share it
+        endpoint = acceptor.local_endpoint();
+      }
+    } catch (...) {
+      Close();
+      throw;
+    }
+    closed_ = false;
+    RunHandshakeIo();
+    for (auto& acceptor : shard_acceptors_) {
+      StartAccept(acceptor);
+    }
+#else
+    boost::ignore_unused(endpoint);
+    throw std::runtime_error("SO_REUSEPORT not supported");
+#endif
+  }
+
+  void RunHandshakeIo() {
+    setting_.handshake_context = nullptr;
+    if (setting_.handshake_threads > 0) {
+      handshake_io_.Run(setting_.handshake_threads);
+      setting_.handshake_context = [this]() {
+        return &handshake_io_.NextCtx();
+      };
+    }
+  }
+
   void StartAccept() {
     acceptor_.async_accept(
-        socket_, [this](const boost::system::error_code& ec) {
+        socket_io_.NextCtx(),
+        [this](const boost::system::error_code& ec,
+               boost::asio::ip::tcp::socket socket) {
+          if (ec == boost::asio::error::operation_aborted) {
+            return;
+          }
           if (!ec) {
-            boost::beast::tcp_stream stream{std::move(socket_)};
-            stream.expires_after(setting_.read_timeout);
-            std::make_shared<CONNECTION>(std::move(stream),
-                                         boost::beast::flat_buffer{}, ssl_ctx_,
-                                         router_, setting_)
-                ->Run();
+            if (!Admit(socket)) {
+              return AcceptLater(acceptor_.get_executor(),
+                                 [this]() { StartAccept(); });
+            }
+            OnAccept(std::move(socket));
           }
           if (!closed_) {
             StartAccept();
@@ -91,15 +307,86 @@ class HttpBasicServer {
         });
   }
 
+  void StartAccept(boost::asio::ip::tcp::acceptor& acceptor) {
+    acceptor.async_accept([this, &acceptor](
+                              const boost::system::error_code& ec,
+                              boost::asio::ip::tcp::socket socket) {
+      if (ec == boost::asio::error::operation_aborted) {
+        return;
+      }
+      if (!ec) {
+        if (!Admit(socket)) {
+          return AcceptLater(acceptor.get_executor(),
+                             [this, &acceptor]() { StartAccept(acceptor); });
+        }
+        OnAccept(std::move(socket));
+      }
+      if (!closed_) {
+        StartAccept(acceptor);
+      }
+    });
+  }
+
+  // Sheds socket when the admission limit is hit. Nothing is allocated for
+  // it, plain http gets the canned 503, which fits the empty send buffer.
+  bool Admit(boost::asio::ip::tcp::socket& socket) {
+    const auto& admission = setting_.admission;
+    if (!admission || admission->AdmitConnection()) {
+      return true;
+    }
+    boost::system::error_code ec;
+    if constexpr (std::is_same_v<CONNECTION, HttpPlainConnection>) {
+      socket.non_blocking(true, ec);
+      socket.write_some(
+          boost::asio::buffer(*HttpAdmission::ServiceUnavailable()), ec);
+    }
+    socket.shutdown(boost::asio::socket_base::shutdown_both, ec);
+    socket.close(ec);
+    return false;
+  }
+
+  // Calls start after the accept backoff, unless the server closed
+  // meanwhile. The kernel queues the new connections until then.
+  template <class Function>
+  void AcceptLater(const boost::asio::any_io_executor& executor,
+                   Function&& start) {
+    auto timer = std::make_shared<boost::asio::steady_timer>(
+        executor, setting_.admission->accept_backoff());
+    timer->async_wait([this, timer, epoch = epoch_.load(),
+                       start = std::forward<Function>(start)](
+                          const boost::system::error_code&) mutable {
+      if (!closed_ && epoch == epoch_) {
+        start();
+      }
+    });
+  }
+
+  void OnAccept(boost::asio::ip::tcp::socket&& socket) {
+    boost::beast::tcp_stream stream{std::move(socket)};
+    stream.expires_after(setting_.read_timeout);
+    std::make_shared<CONNECTION>(std::move(stream), boost::beast::flat_buffer{},
+                                 ssl_ctx_, router_, setting_)
+        ->Run();
+  }
+
  private:
-  bool closed_ = false;
+  std::atomic<bool> closed_ = false;
+  // Bumped by Close, so that a pending accept backoff of a previous
+  // ListenAndServe doesn't restart accepting.
+  std::atomic<std::size_t> epoch_ = 0;
+  // Handshake reads on socket_io_ hold work on it, so it is destroyed last.
+  IoContextPool handshake_io_;
+  // Declared before accept_io_ so it is destroyed after any pending accept.
+  IoContextPool socket_io_;
   SingleThreadIo accept_io_;
-  SingleThreadIo socket_io_;
   boost::asio::ip::tcp::acceptor acceptor_;
-  boost::asio::ip::tcp::socket socket_;
+  std::vector<boost::asio::ip::tcp::acceptor> shard_acceptors_;
+  // Holds the ticket keys, which the context refers to
+  HttpTlsSetting tls_setting_;
   boost::asio::ssl::context ssl_ctx_{boost::asio::ssl::context::tlsv12};
   HttpRouter router_;
   HttpSetting setting_;
+  std::vector<std::shared_ptr<HttpWorkerPool>> worker_pools_;
 };
 
 // Only for http
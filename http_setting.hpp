@@ -1,20 +1,38 @@
 #pragma once
 #include <chrono>
+#include <functional>
 #include <memory>
 #include <optional>
 #include <string>
 #include <vector>
 
+namespace boost::asio {
+class io_context;
+}
+
 namespace pirest {
 
+class HttpAdmission;
 class HttpFilter;
+class HttpMetrics;
+class HttpTracer;
 
 struct HttpSetting {
   using FilterList = std::vector<std::shared_ptr<HttpFilter>>;
   std::uint32_t header_limit = 8 * 1024;
   std::optional<std::uint64_t> body_limit = 1024 * 1024;
+  std::uint32_t inflate_ratio_limit = 100;
   std::chrono::milliseconds read_timeout = std::chrono::seconds(60);
+  std::size_t io_threads = 1;
+  std::size_t handshake_threads = 0;
+  bool reuse_port = false;
+  std::size_t pipeline_depth = 16;
   FilterList filters;
+  std::shared_ptr<HttpMetrics> metrics;
+  std::shared_ptr<HttpTracer> tracer;
+  std::shared_ptr<HttpAdmission> admission;
+  // Set by the server while handshake threads run, hands out their contexts
+  std::function<boost::asio::io_context*()> handshake_context;
 
   HttpSetting& set_header_limit(std::uint32_t val) noexcept {
     header_limit = val;
@@ -27,11 +45,69 @@ struct HttpSetting {
     return *this;
   }
 
+  // gzip and deflate request bodies are inflated before the handler sees
+  // them, and may grow to at most val times their encoded size besides
+  // body_limit. 0 leaves only body_limit.
+  HttpSetting& set_inflate_ratio_limit(std::uint32_t val) noexcept {
+    inflate_ratio_limit = val;
+    return *this;
+  }
+
   HttpSetting& set_read_timeout(const std::chrono::milliseconds& val) noexcept {
     read_timeout = val;
     return *this;
   }
 
+  // Takes effect on the next ListenAndServe.
+  HttpSetting& set_io_threads(std::size_t val) noexcept {
+    io_threads = val;
+    return *this;
+  }
+
+  // TLS handshakes run on threads of their own, so that a burst of new
+  // connections doesn't stall the requests of the io threads. A connection
+  // is served by its io thread once the handshake is done. 0 keeps the
+  // handshakes on the io threads. Takes effect on the next ListenAndServe.
+  HttpSetting& set_handshake_threads(std::size_t val) noexcept {
+    handshake_threads = val;
+    return *this;
+  }
+
+  // One SO_REUSEPORT acceptor per io thread instead of a shared accept thread.
+  // Takes effect on the next ListenAndServe.
+  HttpSetting& set_reuse_port(bool val) noexcept {
+    reuse_port = val;
+    return *this;
+  }
+
+  // Responses a connection queues before it stops reading pipelined requests,
+  // 1 disables pipelining. Takes effect on new connections.
+  HttpSetting& set_pipeline_depth(std::size_t val) noexcept {
+    pipeline_depth = val;
+    return *this;
+  }
+
+  // Counts connections, bytes and per route latencies, null disables them.
+  // Takes effect on new connections.
+  HttpSetting& set_metrics(const std::shared_ptr<HttpMetrics>& val) noexcept {
+    metrics = val;
+    return *this;
+  }
+
+  // Times the phases of sampled requests, when built with PIREST_TRACING.
+  HttpSetting& set_tracer(const std::shared_ptr<HttpTracer>& val) noexcept {
+    tracer = val;
+    return *this;
+  }
+
+  // Connection and request limits, null for none. Takes effect on new
+  // connections.
+  HttpSetting& set_admission(
+      const std::shared_ptr<HttpAdmission>& val) noexcept {
+    admission = val;
+    return *this;
+  }
+
   HttpSetting& AddFilter(const std::shared_ptr<HttpFilter>& filter) {
     filters.emplace_back(filter);
     return *this;
@@ -0,0 +1,321 @@
+#pragma once
+#include <array>
+#include <boost/asio/ssl/context.hpp>
+#include <boost/asio/ssl/error.hpp>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#include <optional>
+#include <string>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
+namespace pirest {
+
+// The last OpenSSL error of this thread
+[[noreturn]] static void ThrowTlsError(const char* what) {
+  boost::system::error_code ec{static_cast<int>(::ERR_get_error()),
+                               boost::asio::error::get_ssl_category()};
+  throw boost::system::system_error{ec, what};
+}
+
+// The keys session tickets are sealed with. A new key takes over every
+// interval, the keep keys before it still open tickets, which are then
+// reissued under the current key. Shared by servers that should resume each
+// other's sessions.
+class HttpTicketKeys {
+ public:
+  explicit HttpTicketKeys(
+      std::chrono::seconds interval = std::chrono::hours(12),
+      std::size_t keep = 2)
+      : interval_{interval}, keep_{keep} {
+    Rotate();
+  }
+
+  // Replaces the current key now
+  void Rotate() {
+    auto key = NewKey();
+    std::lock_guard<std::mutex> lock{mutex_};
+    Push(key);
+  }
+
+  // Seals and opens the tickets of ctx until another callback is set. Keeps
+  // no reference, the keys must outlive ctx.
+  void Install(SSL_CTX* ctx) {
+    SSL_CTX_set_ex_data(ctx, ExIndex(), this);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, &TicketKeyCallback);
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb(ctx, &TicketKeyCallback);
+#endif
+  }
+
+ private:
+  struct Key {
+    std::array<unsigned char, 16> name;
+    std::array<unsigned char, 32> hmac;
+    std::array<unsigned char, 32> aes;
+    std::chrono::steady_clock::time_point created;
+  };
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  using MacContext = EVP_MAC_CTX;
+#else
+  using MacContext = HMAC_CTX;
+#endif
+
+  static int ExIndex() {
+    static const int index =
+        SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+    return index;
+  }
+
+  static Key NewKey() {
+    Key key;
+    if (RAND_bytes(key.name.data(), key.name.size()) != 1 ||
+        RAND_bytes(key.hmac.data(), key.hmac.size()) != 1 ||
+        RAND_bytes(key.aes.data(), key.aes.size()) != 1) {
+      ThrowTlsError("RAND_bytes");
+    }
+    key.created = std::chrono::steady_clock::now();
+    return key;
+  }
+
+  void Push(const Key& key) {
+    keys_.push_front(key);
+    while (keys_.size() > keep_ + 1) {
+      keys_.pop_back();
+    }
+  }
+
+  Key Current() {
+    std::lock_guard<std::mutex> lock{mutex_};
+    if (std::chrono::steady_clock::now() - keys_.front().created >=
+        interval_) {
+      Push(NewKey());
+    }
+    return keys_.front();
+  }
+
+  // The position of the key named name, 0 for the current one
+  std::optional<std::size_t> Find(const unsigned char* name, Key& key) {
+    std::lock_guard<std::mutex> lock{mutex_};
+    for (std::size_t i = 0; i < keys_.size(); ++i) {
+      if (std::memcmp(keys_[i].name.data(), name, keys_[i].name.size()) == 0) {
+        key = keys_[i];
+        return i;
+      }
+    }
+    return std::nullopt;
+  }
+
+  static bool InitMac(MacContext* mac, const Key& key) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+                                         const_cast<char*>("SHA256"), 0),
+        OSSL_PARAM_construct_end()};
+    return EVP_MAC_init(mac, key.hmac.data(), key.hmac.size(), params) == 1;
+#else
+    return HMAC_Init_ex(mac, key.hmac.data(), static_cast<int>(key.hmac.size()),
+                        EVP_sha256(), nullptr) == 1;
+#endif
+  }
+
+  // 1 on success, 2 to also renew the ticket, 0 to make a full handshake
+  static int TicketKeyCallback(SSL* ssl, unsigned char* key_name,
+                               unsigned char* iv, EVP_CIPHER_CTX* cipher,
+                               MacContext* mac, int enc) {
+    auto keys = static_cast<HttpTicketKeys*>(
+        SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ExIndex()));
+    if (!keys) {
+      return -1;
+    }
+    Key key;
+    if (enc) {
+      try {
+        key = keys->Current();
+      } catch (const std::exception&) {
+        return -1;
+      }
+      if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1) {
+        return -1;
+      }
+      std::memcpy(key_name, key.name.data(), key.name.size());
+      if (EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr,
+                             key.aes.data(), iv) != 1 ||
+          !InitMac(mac, key)) {
+        return -1;
+      }
+      return 1;
+    }
+    auto index = keys->Find(key_name, key);
+    if (!index) {
+      return 0;
+    }
+    if (!InitMac(mac, key) ||
+        EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key.aes.data(),
+                           iv) != 1) {
+      return -1;
+    }
+    return *index == 0 ? 1 : 2;
+  }
+
+  std::chrono::seconds interval_;
+  std::size_t keep_;
+  std::mutex mutex_;
+  std::deque<Key> keys_;
+};
+
+// The certificate and protocol of an https server, and how clients resume
+// their sessions: with tickets, which the server doesn't store, or from the
+// session cache.
+struct HttpTlsSetting {
+  std::string certificate_chain_file;
+  std::string private_key_file;
+  std::string certificate_chain;
+  std::string private_key;
+  std::string cipher_list;
+  std::string ciphersuites;
+  int min_version = TLS1_2_VERSION;
+  int max_version = 0;
+  std::size_t session_cache_size = 20 * 1024;
+  std::chrono::seconds session_timeout = std::chrono::hours(2);
+  bool session_tickets = true;
+  std::shared_ptr<HttpTicketKeys> ticket_keys;
+
+  // PEM files
+  HttpTlsSetting& set_certificate_chain_file(const std::string& val) {
+    certificate_chain_file = val;
+    return *this;
+  }
+
+  HttpTlsSetting& set_private_key_file(const std::string& val) {
+    private_key_file = val;
+    return *this;
+  }
+
+  // PEM in memory
+  HttpTlsSetting& set_certificate_chain(const std::string& val) {
+    certificate_chain = val;
+    return *this;
+  }
+
+  HttpTlsSetting& set_private_key(const std::string& val) {
+    private_key = val;
+    return *this;
+  }
+
+  // TLS 1.2 ciphers in the OpenSSL cipher list format, in server preference
+  HttpTlsSetting& set_cipher_list(const std::string& val) {
+    cipher_list = val;
+    return *this;
+  }
+
+  // TLS 1.3 suites, e.g. "TLS_AES_128_GCM_SHA256:TLS_CHACHA20_POLY1305_SHA256"
+  HttpTlsSetting& set_ciphersuites(const std::string& val) {
+    ciphersuites = val;
+    return *this;
+  }
+
+  // TLS1_2_VERSION, TLS1_3_VERSION, max 0 for the highest supported
+  HttpTlsSetting& set_versions(int min, int max = 0) noexcept {
+    min_version = min;
+    max_version = max;
+    return *this;
+  }
+
+  // Sessions kept for resumption by session id, 0 disables the cache
+  HttpTlsSetting& set_session_cache_size(std::size_t val) noexcept {
+    session_cache_size = val;
+    return *this;
+  }
+
+  // How long cached sessions and tickets resume
+  HttpTlsSetting& set_session_timeout(std::chrono::seconds val) noexcept {
+    session_timeout = val;
+    return *this;
+  }
+
+  HttpTlsSetting& set_session_tickets(bool val) noexcept {
+    session_tickets = val;
+    return *this;
+  }
+
+  // Keys to seal tickets with, by default each server makes its own
+  HttpTlsSetting& set_ticket_keys(const std::shared_ptr<HttpTicketKeys>& val) {
+    ticket_keys = val;
+    return *this;
+  }
+
+  // Throws boost::system::system_error. Creates ticket_keys if tickets are
+  // on and there are none.
+  void Apply(boost::asio::ssl::context& ctx) {
+    if (!certificate_chain_file.empty()) {
+      ctx.use_certificate_chain_file(certificate_chain_file);
+    }
+    if (!private_key_file.empty()) {
+      ctx.use_private_key_file(private_key_file,
+                               boost::asio::ssl::context::pem);
+    }
+    if (!certificate_chain.empty()) {
+      ctx.use_certificate_chain(boost::asio::buffer(certificate_chain));
+    }
+    if (!private_key.empty()) {
+      ctx.use_private_key(boost::asio::buffer(private_key),
+                          boost::asio::ssl::context::pem);
+    }
+    auto handle = ctx.native_handle();
+    Check(SSL_CTX_set_min_proto_version(handle, min_version),
+          "SSL_CTX_set_min_proto_version");
+    Check(SSL_CTX_set_max_proto_version(handle, max_version),
+          "SSL_CTX_set_max_proto_version");
+    if (!cipher_list.empty()) {
+      Check(SSL_CTX_set_cipher_list(handle, cipher_list.c_str()),
+            "SSL_CTX_set_cipher_list");
+    }
+    if (!ciphersuites.empty()) {
+      Check(SSL_CTX_set_ciphersuites(handle, ciphersuites.c_str()),
+            "SSL_CTX_set_ciphersuites");
+    }
+    SSL_CTX_set_options(handle, SSL_OP_CIPHER_SERVER_PREFERENCE |
+                                    SSL_OP_NO_RENEGOTIATION);
+
+    static const unsigned char kSessionContext[] = "pirest";
+    Check(SSL_CTX_set_session_id_context(handle, kSessionContext,
+                                         sizeof(kSessionContext) - 1),
+          "SSL_CTX_set_session_id_context");
+    SSL_CTX_set_session_cache_mode(handle, session_cache_size > 0
+                                               ? SSL_SESS_CACHE_SERVER
+                                               : SSL_SESS_CACHE_OFF);
+    SSL_CTX_sess_set_cache_size(handle, static_cast<long>(session_cache_size));
+    SSL_CTX_set_timeout(handle, static_cast<long>(session_timeout.count()));
+    if (session_tickets) {
+      if (!ticket_keys) {
+        ticket_keys = std::make_shared<HttpTicketKeys>();
+      }
+      SSL_CTX_clear_options(handle, SSL_OP_NO_TICKET);
+      ticket_keys->Install(handle);
+    } else {
+      SSL_CTX_set_options(handle, SSL_OP_NO_TICKET);
+    }
+  }
+
+ private:
+  static void Check(int result, const char* what) {
+    if (result != 1) {
+      ThrowTlsError(what);
+    }
+  }
+};
+
+}  // namespace pirest
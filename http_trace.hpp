@@ -0,0 +1,284 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Request tracing is compiled in with PIREST_TRACING defined, else
+// HttpRequestTrace is empty and its calls compile to nothing.
+
+namespace pirest {
+
+enum class HttpTracePhase : std::uint8_t {
+  kHandshake,
+  kReadHeader,
+  kReadBody,
+  kFilters,
+  // Routing and the handler, until the response is queued
+  kHandler,
+  // Queued and written
+  kWrite,
+};
+
+inline const char* HttpTracePhaseName(HttpTracePhase phase) noexcept {
+  switch (phase) {
+    case HttpTracePhase::kHandshake:
+      return "handshake";
+    case HttpTracePhase::kReadHeader:
+      return "read_header";
+    case HttpTracePhase::kReadBody:
+      return "read_body";
+    case HttpTracePhase::kFilters:
+      return "filters";
+    case HttpTracePhase::kHandler:
+      return "handler";
+    case HttpTracePhase::kWrite:
+      return "write";
+  }
+  return "";
+}
+
+// The TSC where there is one, it's read in a few cycles without a syscall.
+// Ticks turn to time against steady_clock, measured over the whole run.
+class HttpTraceClock {
+ public:
+  static std::uint64_t Now() noexcept {
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return static_cast<std::uint64_t>(
+        std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+  }
+
+  // Microseconds from the first call on
+  static double ToMicroseconds(std::uint64_t ticks) noexcept {
+    const auto& epoch = Epoch();
+    auto now = std::chrono::steady_clock::now();
+    auto elapsed_ticks = Now() - epoch.ticks;
+    if (elapsed_ticks == 0) {
+      return 0;
+    }
+    auto elapsed_us =
+        std::chrono::duration<double, std::micro>(now - epoch.time).count();
+    return static_cast<double>(ticks - epoch.ticks) * elapsed_us /
+           static_cast<double>(elapsed_ticks);
+  }
+
+ private:
+  struct Point {
+    std::uint64_t ticks = Now();
+    std::chrono::steady_clock::time_point time =
+        std::chrono::steady_clock::now();
+  };
+
+  static const Point& Epoch() noexcept {
+    static const Point epoch;
+    return epoch;
+  }
+};
+
+struct HttpTraceSpan {
+  std::uint64_t begin;
+  std::uint64_t end;
+  std::uint64_t request;
+  std::uint32_t thread;
+  HttpTracePhase phase;
+};
+
+// Samples requests and hands their spans to sink in batches, from the
+// thread that recorded them: when its ring fills, or when the thread exits.
+// The sink is called under a lock.
+class HttpTracer {
+ public:
+  using Sink = std::function<void(const HttpTraceSpan*, std::size_t)>;
+
+  explicit HttpTracer(Sink sink) : sink_{std::move(sink)} {
+    HttpTraceClock::ToMicroseconds(HttpTraceClock::Now());
+  }
+
+  // Traces one request in every 1 / rate, 0 traces none.
+  HttpTracer& set_sample_rate(double rate) noexcept {
+    sample_every_.store(rate > 0 ? static_cast<std::uint64_t>(
+                                       std::llround(1 / std::min(rate, 1.0)))
+                                 : 0,
+                        std::memory_order_relaxed);
+    return *this;
+  }
+
+  // A request id, or 0 when the request isn't traced
+  std::uint64_t Sample() noexcept {
+    auto every = sample_every_.load(std::memory_order_relaxed);
+    if (every == 0) {
+      return 0;
+    }
+    auto n = next_.fetch_add(1, std::memory_order_relaxed);
+    return n % every == 0 ? n / every + 1 : 0;
+  }
+
+  void Export(const HttpTraceSpan* spans, std::size_t size) {
+    std::lock_guard<std::mutex> lock{mutex_};
+    sink_(spans, size);
+  }
+
+ private:
+  Sink sink_;
+  std::mutex mutex_;
+  std::atomic<std::uint64_t> sample_every_{1};
+  std::atomic<std::uint64_t> next_{0};
+};
+
+// The spans a thread recorded and not yet exported
+class HttpTraceRing {
+ public:
+  static constexpr std::size_t kCapacity = 1024;
+
+  ~HttpTraceRing() { Flush(); }
+
+  static HttpTraceRing& Local() noexcept {
+    thread_local HttpTraceRing ring;
+    return ring;
+  }
+
+  void Push(const std::shared_ptr<HttpTracer>& tracer, HttpTracePhase phase,
+            std::uint64_t request, std::uint64_t begin, std::uint64_t end) {
+    if (tracer != tracer_ || size_ == kCapacity) {
+      Flush();
+      tracer_ = tracer;
+    }
+    spans_[size_++] = {begin, end, request, thread_, phase};
+  }
+
+  void Flush() {
+    if (tracer_ && size_ > 0) {
+      tracer_->Export(spans_.data(), size_);
+    }
+    size_ = 0;
+  }
+
+ private:
+  HttpTraceRing() noexcept {
+    static std::atomic<std::uint32_t> next{1};
+    thread_ = next.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  std::shared_ptr<HttpTracer> tracer_;
+  std::array<HttpTraceSpan, kCapacity> spans_;
+  std::size_t size_ = 0;
+  std::uint32_t thread_;
+};
+
+#ifdef PIREST_TRACING
+
+// The phases of one sampled request, each one ends where the next begins.
+class HttpRequestTrace {
+ public:
+  HttpRequestTrace() noexcept = default;
+
+  HttpRequestTrace(HttpRequestTrace&& other) noexcept {
+    *this = std::move(other);
+  }
+
+  HttpRequestTrace& operator=(HttpRequestTrace&& other) noexcept {
+    tracer_ = std::move(other.tracer_);
+    request_ = std::exchange(other.request_, 0);
+    begin_ = other.begin_;
+    phase_ = other.phase_;
+    return *this;
+  }
+
+  void Start(const std::shared_ptr<HttpTracer>& tracer,
+             HttpTracePhase phase) {
+    request_ = tracer ? tracer->Sample() : 0;
+    if (request_ != 0) {
+      tracer_ = tracer;
+      phase_ = phase;
+      begin_ = HttpTraceClock::Now();
+    }
+  }
+
+  void Begin(HttpTracePhase phase) {
+    if (request_ != 0) {
+      auto now = HttpTraceClock::Now();
+      HttpTraceRing::Local().Push(tracer_, phase_, request_, begin_, now);
+      phase_ = phase;
+      begin_ = now;
+    }
+  }
+
+  void End() {
+    if (request_ != 0) {
+      HttpTraceRing::Local().Push(tracer_, phase_, request_, begin_,
+                                  HttpTraceClock::Now());
+      request_ = 0;
+    }
+  }
+
+ private:
+  std::shared_ptr<HttpTracer> tracer_;
+  std::uint64_t request_ = 0;
+  std::uint64_t begin_ = 0;
+  HttpTracePhase phase_ = HttpTracePhase::kReadHeader;
+};
+
+#else
+
+class HttpRequestTrace {
+ public:
+  void Start(const std::shared_ptr<HttpTracer>&, HttpTracePhase) noexcept {}
+
+  void Begin(HttpTracePhase) noexcept {}
+
+  void End() noexcept {}
+};
+
+#endif
+
+// A sink writing the Chrome trace event format, which chrome://tracing and
+// Perfetto open. One row per io thread, the request id is in the args.
+class HttpChromeTraceWriter {
+ public:
+  explicit HttpChromeTraceWriter(const std::string& path) {
+    if (auto file = std::fopen(path.c_str(), "w")) {
+      file_.reset(file, &std::fclose);
+      std::fputs("[\n", file);
+    }
+  }
+
+  void operator()(const HttpTraceSpan* spans, std::size_t size) {
+    if (!file_) {
+      return;
+    }
+    for (std::size_t i = 0; i < size; ++i) {
+      const auto& span = spans[i];
+      auto begin = HttpTraceClock::ToMicroseconds(span.begin);
+      auto end = HttpTraceClock::ToMicroseconds(span.end);
+      std::fprintf(file_.get(),
+                   "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+                   "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"request\":%llu}},\n",
+                   HttpTracePhaseName(span.phase), span.thread, begin,
+                   end - begin, static_cast<unsigned long long>(span.request));
+    }
+    std::fflush(file_.get());
+  }
+
+ private:
+  // Shared, the tracer keeps a copy of its sink. The trailing "]" is
+  // optional in the format.
+  std::shared_ptr<std::FILE> file_;
+};
+
+}  // namespace pirest
@@ -1,6 +1,9 @@
 #pragma once
 #include <algorithm>
+#include <cctype>
+#include <cstdint>
 #include <string>
+#include <string_view>
 
 namespace pirest {
 
@@ -12,8 +15,156 @@ static void ToUpper(std::string& str) noexcept {
   std::transform(str.begin(), str.end(), str.begin(), toupper);
 }
 
-static void TrimAllSpace(std::string& str) noexcept {
-  str.erase(remove_if(str.begin(), str.end(), isspace), str.end());
+// ASCII only, which is all HTTP tokens need, and unlike tolower inlines
+static char AsciiLower(char c) noexcept {
+  return c >= 'A' && c <= 'Z' ? static_cast<char>(c + ('a' - 'A')) : c;
 }
 
+static bool IEquals(std::string_view lhs, std::string_view rhs) noexcept {
+  return lhs.size() == rhs.size() &&
+         std::equal(lhs.begin(), lhs.end(), rhs.begin(), [](char a, char b) {
+           return AsciiLower(a) == AsciiLower(b);
+         });
+}
+
+static bool IStartsWith(std::string_view str,
+                        std::string_view prefix) noexcept {
+  return str.size() >= prefix.size() &&
+         IEquals(str.substr(0, prefix.size()), prefix);
+}
+
+// Whether pred holds for every item of a comma separated header value, the
+// items trimmed and empty ones skipped
+template <typename Pred>
+static bool AllListItems(std::string_view list, Pred&& pred) {
+  while (!list.empty()) {
+    auto comma = list.find(',');
+    auto item = list.substr(0, comma);
+    list.remove_prefix(comma == list.npos ? list.size() : comma + 1);
+    auto begin = item.find_first_not_of(" \t");
+    if (begin == item.npos) {
+      continue;
+    }
+    item = item.substr(begin, item.find_last_not_of(" \t") + 1 - begin);
+    if (!pred(item)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static int HexValue(char c) noexcept {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// Decodes the char at str[pos] of a query component ("%XX" and '+'), returns
+// the number of chars consumed.
+static std::size_t DecodeQueryChar(std::string_view str, std::size_t pos,
+                                   char& c) noexcept {
+  if (str[pos] == '+') {
+    c = ' ';
+    return 1;
+  }
+  if (str[pos] == '%' && pos + 2 < str.size()) {
+    auto high = HexValue(str[pos + 1]);
+    auto low = HexValue(str[pos + 2]);
+    if (high >= 0 && low >= 0) {
+      c = static_cast<char>(high * 16 + low);
+      return 3;
+    }
+  }
+  c = str[pos];
+  return 1;
+}
+
+static std::string DecodeQuery(std::string_view str) {
+  std::string out;
+  out.reserve(str.size());
+  for (std::size_t pos = 0; pos < str.size();) {
+    char c;
+    pos += DecodeQueryChar(str, pos, c);
+    out.push_back(c);
+  }
+  return out;
+}
+
+// Returns str itself when there is nothing to decode, else decodes into buffer
+static std::string_view DecodeQuery(std::string_view str,
+                                    std::string& buffer) {
+  if (str.find_first_of("%+") == str.npos) {
+    return str;
+  }
+  buffer = DecodeQuery(str);
+  return buffer;
+}
+
+// Percent-decodes a path, where '+' stays literal. Returns str itself when
+// there is nothing to decode, else decodes into buffer
+static std::string_view DecodePath(std::string_view str, std::string& buffer) {
+  if (str.find('%') == str.npos) {
+    return str;
+  }
+  buffer.clear();
+  buffer.reserve(str.size());
+  for (std::size_t pos = 0; pos < str.size();) {
+    char c = str[pos];
+    pos += c == '+' ? 1 : DecodeQueryChar(str, pos, c);
+    buffer.push_back(c);
+  }
+  return buffer;
+}
+
+// Case-insensitive compare of an encoded query component with a plain string
+static bool IEqualsQuery(std::string_view encoded,
+                         std::string_view plain) noexcept {
+  std::size_t pos = 0;
+  for (auto p : plain) {
+    if (pos == encoded.size()) {
+      return false;
+    }
+    char c;
+    pos += DecodeQueryChar(encoded, pos, c);
+    if (tolower(static_cast<unsigned char>(c)) !=
+        tolower(static_cast<unsigned char>(p))) {
+      return false;
+    }
+  }
+  return pos == encoded.size();
+}
+
+// Case-insensitive hash and equal for unordered containers, both transparent
+// so lookups by std::string_view do not allocate.
+struct IHash {
+  using is_transparent = void;
+
+  std::size_t operator()(std::string_view str) const noexcept {
+    std::uint64_t hash = 14695981039346656037ULL;
+    for (auto c : str) {
+      hash ^= static_cast<unsigned char>(AsciiLower(c));
+      hash *= 1099511628211ULL;
+    }
+    return static_cast<std::size_t>(hash);
+  }
+};
+
+struct IEqual {
+  using is_transparent = void;
+
+  bool operator()(std::string_view lhs, std::string_view rhs) const noexcept {
+    return IEquals(lhs, rhs);
+  }
+};
+
+// Transparent hash so std::string keyed maps can be searched by string_view.
+struct StringHash {
+  using is_transparent = void;
+
+  std::size_t operator()(std::string_view str) const noexcept {
+    return std::hash<std::string_view>{}(str);
+  }
+};
+
 }  // namespace pirest
@@ -0,0 +1,87 @@
+#pragma once
+#include <atomic>
+#include <boost/asio/post.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <condition_variable>
+#include <mutex>
+#include <pirest/http_allocator.hpp>
+
+namespace pirest {
+
+// Threads for handlers that block, e.g. on a database, so that they don't
+// stall the other connections of an io thread. At most queue_limit tasks
+// wait for a thread, beyond that TryPost refuses them. Tasks hold
+// connections, so a server drains the pools of its routes when it closes.
+class HttpWorkerPool {
+ public:
+  HttpWorkerPool(std::size_t threads, std::size_t queue_limit)
+      : pool_{threads}, queue_limit_{queue_limit} {}
+
+  ~HttpWorkerPool() noexcept { Close(); }
+
+  HttpWorkerPool(const HttpWorkerPool&) = delete;
+
+  // Runs task() on a worker, false if the queue is full
+  template <class Task>
+  bool TryPost(Task&& task) {
+    if (queued_.fetch_add(1, std::memory_order_relaxed) >= queue_limit_) {
+      queued_.fetch_sub(1, std::memory_order_relaxed);
+      return false;
+    }
+    unfinished_.fetch_add(1, std::memory_order_relaxed);
+    boost::asio::post(
+        pool_, MakeRecyclingHandler(
+                   [this, task = std::forward<Task>(task)]() mutable {
+                     queued_.fetch_sub(1, std::memory_order_relaxed);
+                     {
+                       // Destroyed before Drain returns
+                       auto run = std::move(task);
+                       run();
+                     }
+                     Finish();
+                   }));
+    return true;
+  }
+
+  // Tasks waiting for a thread
+  std::size_t queued() const noexcept {
+    return queued_.load(std::memory_order_relaxed);
+  }
+
+  // Waits until the tasks posted so far have run, or Close dropped them.
+  // Mustn't be called from a task.
+  void Drain() {
+    std::unique_lock<std::mutex> lock{mutex_};
+    drained_.wait(lock, [this]() {
+      return closed_ || unfinished_.load(std::memory_order_acquire) == 0;
+    });
+  }
+
+  // Waits for the running tasks, the waiting ones never run
+  void Close() noexcept {
+    pool_.stop();
+    pool_.join();
+    std::lock_guard<std::mutex> lock{mutex_};
+    closed_ = true;
+    drained_.notify_all();
+  }
+
+ private:
+  boost::asio::thread_pool pool_;
+  std::size_t queue_limit_;
+  void Finish() {
+    if (unfinished_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      std::lock_guard<std::mutex> lock{mutex_};
+      drained_.notify_all();
+    }
+  }
+
+  std::atomic<std::size_t> queued_{0};
+  // Posted and not yet run to the end
+  std::atomic<std::size_t> unfinished_{0};
+  std::mutex mutex_;
+  std::condition_variable drained_;
+  bool closed_ = false;
+};
+
+}  // namespace pirest
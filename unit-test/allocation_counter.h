@@ -0,0 +1,55 @@
+#pragma once
+#include <pirest/http_connection.hpp>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// Replaces the global operator new and delete, so that a test or benchmark
+// can count the allocations made while counting is set, on any thread. A
+// program may include it in one source file only.
+
+namespace {
+
+std::atomic<bool> counting{false};
+std::atomic<std::size_t> allocations{0};
+
+// The filters only touch the request, the remote address and the allowed
+// origin, so the connection needs no socket.
+class RequestOnlyConnection : public pirest::HttpConnection {
+ public:
+  explicit RequestOnlyConnection(pirest::HttpRequest&& req) {
+    request_ = std::move(req);
+  }
+
+  void set_remote_address(const boost::asio::ip::address& address) noexcept {
+    remote_address_ = address;
+  }
+};
+
+// Out of line, so that the compiler doesn't inline malloc and free into the
+// new and delete expressions and then warn that they don't match.
+[[gnu::noinline]] void* Allocate(std::size_t size) {
+  if (counting.load(std::memory_order_relaxed)) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+  }
+  if (auto ptr = std::malloc(size ? size : 1)) {
+    return ptr;
+  }
+  throw std::bad_alloc{};
+}
+
+[[gnu::noinline]] void Release(void* ptr) noexcept { std::free(ptr); }
+
+}  // namespace
+
+void* operator new(std::size_t size) { return Allocate(size); }
+
+void* operator new[](std::size_t size) { return Allocate(size); }
+
+void operator delete(void* ptr) noexcept { Release(ptr); }
+
+void operator delete[](void* ptr) noexcept { Release(ptr); }
+
+void operator delete(void* ptr, std::size_t) noexcept { Release(ptr); }
+
+void operator delete[](void* ptr, std::size_t) noexcept { Release(ptr); }
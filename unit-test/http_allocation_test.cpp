@@ -0,0 +1,103 @@
+// clang-format off
+#include "pch.h"
+// clang-format on
+
+#include <pirest/http_cors_filter.hpp>
+#include <pirest/http_server.hpp>
+
+#include "allocation_counter.h"
+
+using namespace pirest;
+
+TEST(HttpAllocationTest, TestRecyclingAllocator) {
+  RecyclingAllocator<char> alloc;
+  auto first = alloc.allocate(100);
+  alloc.deallocate(first, 100);
+  auto second = alloc.allocate(120);
+  ASSERT_EQ(first, second);
+  alloc.deallocate(second, 120);
+
+  counting = true;
+  for (auto i = 0; i < 100; ++i) {
+    auto ptr = alloc.allocate(1000);
+    alloc.deallocate(ptr, 1000);
+  }
+  counting = false;
+  ASSERT_LE(allocations.exchange(0), 1);
+}
+
+TEST(HttpAllocationTest, TestKeepAliveSteadyState) {
+  HttpPlainServer server;
+  server.HandleFunc(
+      "/ping",
+      [](const HttpConnection::Ptr& conn) {
+        conn->Respond(boost::beast::http::status::ok);
+      },
+      {"GET"});
+  server.ListenAndServe("127.0.0.1", 0);
+
+  boost::asio::io_context ctx;
+  boost::asio::ip::tcp::socket socket{ctx};
+  socket.connect(server.local_endpoint());
+  // Raw socket calls on the client side, so every allocation counted below
+  // belongs to the server.
+  static const char kRequest[] =
+      "GET /ping HTTP/1.1\r\nHost: localhost\r\n\r\n";
+  static const std::string_view kResponse =
+      "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n";
+  auto round_trip = [&] {
+    boost::asio::write(socket,
+                       boost::asio::buffer(kRequest, sizeof(kRequest) - 1));
+    char buffer[64];
+    std::size_t size = 0;
+    while (size < kResponse.size()) {
+      size += socket.read_some(
+          boost::asio::buffer(buffer + size, sizeof(buffer) - size));
+    }
+    return std::string_view{buffer, size} == kResponse;
+  };
+
+  for (auto i = 0; i < 100; ++i) {
+    ASSERT_TRUE(round_trip());
+  }
+  auto ok = true;
+  allocations = 0;
+  counting = true;
+  for (auto i = 0; i < 1000 && ok; ++i) {
+    ok = round_trip();
+  }
+  counting = false;
+  ASSERT_TRUE(ok);
+  ASSERT_EQ(allocations.exchange(0), 0);
+}
+
+TEST(HttpAllocationTest, TestCorsFilter) {
+  HttpCorsFilter filter;
+  filter
+      .set_allow_origins({"https://app.example.com", "https://example.com:443"})
+      .set_allow_methods({"GET", "POST"})
+      .set_expose_headers({"X-Request-Id"});
+  HttpRequest req{boost::beast::http::verb::get, "/", 11};
+  req.set(boost::beast::http::field::origin, "https://App.Example.com");
+  HttpConnection::Ptr conn =
+      std::make_shared<RequestOnlyConnection>(std::move(req));
+  auto pass = [&] {
+    auto result = filter.OnIncomingRequest(conn);
+    HttpResponseHeader resp;
+    filter.OnOutgingResponse(conn, resp);
+    return result == HttpFilter::Result::kPassed &&
+           resp[boost::beast::http::field::access_control_allow_origin] ==
+               "https://App.Example.com";
+  };
+
+  ASSERT_TRUE(pass());
+  auto ok = true;
+  allocations = 0;
+  counting = true;
+  for (auto i = 0; i < 100 && ok; ++i) {
+    ok = pass();
+  }
+  counting = false;
+  ASSERT_TRUE(ok);
+  ASSERT_EQ(allocations.exchange(0), 0);
+}
@@ -8,6 +8,21 @@
 using namespace pirest;
 using namespace ::testing;
 
+struct Point {
+  int x = 0;
+  int y = 0;
+};
+
+template <>
+struct pirest::ArgumentParser<Point> {
+  static bool Parse(std::string_view str, Point& value) {
+    auto pos = str.find(',');
+    return pos != str.npos &&
+           ArgumentParser<int>::Parse(str.substr(0, pos), value.x) &&
+           ArgumentParser<int>::Parse(str.substr(pos + 1), value.y);
+  }
+};
+
 class HttpRouterTest : public ::testing::Test {
  protected:
   void SetUp() override {}
@@ -156,9 +171,231 @@ TEST_F(HttpRouterTest, TestArgumentMatchRouting) {
     router.Routing(conn, "GET", "/hello/kitty/world/not_number");
     FAIL() << "unreachable";
   } catch (const std::exception& e) {
-    std::string_view ev{e.what()};
-    auto pos = ev.find("bad lexical cast");
-    ASSERT_NE(pos, ev.npos);
+    ASSERT_STREQ(e.what(), "Bad argument");
+  }
+  ASSERT_EQ(index, 0);
+}
+
+TEST_F(HttpRouterTest, TestRouteOrder) {
+  int index = 0;
+  router.AddRoute("/{}/world",
+                  [&](const HttpConnection::Ptr&, std::string) { index = 1; },
+                  {"GET"});
+  router.AddRoute("/hello/{}",
+                  [&](const HttpConnection::Ptr&, std::string name) {
+                    index = 2;
+                    ASSERT_EQ(name, "kitty");
+                  },
+                  {"GET"});
+  router.AddRoute("/hello/world",
+                  [&](const HttpConnection::Ptr&) { index = 3; }, {"GET"});
+  router.AddRoute("/file/{}.{}",
+                  [&](const HttpConnection::Ptr&, std::string name,
+                      std::string ext) {
+                    index = 4;
+                    ASSERT_EQ(name, "a.tar");
+                    ASSERT_EQ(ext, "gz");
+                  },
+                  {"GET"});
+
+  // Parameterized routes match in the order they were added
+  index = 0;
+  router.Routing(conn, "GET", "/HELLO/world");
+  ASSERT_EQ(index, 1);
+
+  index = 0;
+  router.Routing(conn, "GET", "/Hello/kitty");
+  ASSERT_EQ(index, 2);
+
+  // Static routes always win
+  index = 0;
+  router.Routing(conn, "GET", "/hello/world");
+  ASSERT_EQ(index, 3);
+
+  index = 0;
+  router.Routing(conn, "GET", "/FILE/a.tar.gz");
+  ASSERT_EQ(index, 4);
+
+  index = 0;
+  try {
+    router.Routing(conn, "GET", "/file/abc");
+    FAIL() << "unreachable";
+  } catch (const std::exception& e) {
+    ASSERT_STREQ(e.what(), "Route not found");
+  }
+  ASSERT_EQ(index, 0);
+}
+
+TEST_F(HttpRouterTest, TestQueryArgument) {
+  int index = 0;
+  router.AddRoute("/user?Name&age",
+                  [&](const HttpConnection::Ptr&, std::string name, int age) {
+                    index = 1;
+                    ASSERT_EQ(name, "hello kitty");
+                    ASSERT_EQ(age, 18);
+                  },
+                  {"GET"});
+  router.AddRoute("/user?name",
+                  [&](const HttpConnection::Ptr&, std::string name) {
+                    index = 2;
+                    ASSERT_EQ(name, "");
+                  },
+                  {"GET"});
+
+  // Keys are case-insensitive and may be encoded, the first one wins
+  index = 0;
+  router.Routing(conn, "GET", "/user?NAME=hello+kitty&%61ge=18&name=xxx");
+  ASSERT_EQ(index, 1);
+
+  index = 0;
+  router.Routing(conn, "GET", "/user?age=18&name=hello%20kitty");
+  ASSERT_EQ(index, 1);
+
+  index = 0;
+  router.Routing(conn, "GET", "/user?name&ages=18");
+  ASSERT_EQ(index, 2);
+
+  index = 0;
+  try {
+    router.Routing(conn, "GET", "/user?nick_name=xxx");
+    FAIL() << "unreachable";
+  } catch (const std::exception& e) {
+    ASSERT_STREQ(e.what(), "Parameter mismatch");
   }
   ASSERT_EQ(index, 0);
 }
+
+TEST_F(HttpRouterTest, TestArgumentConversion) {
+  int index = 0;
+  router.AddRoute("/number/{}/{}?b",
+                  [&](const HttpConnection::Ptr&, std::int16_t i, double d,
+                      std::optional<bool> b) {
+                    index = 1;
+                    ASSERT_EQ(i, 5);
+                    ASSERT_EQ(d, 1.5);
+                    if (b) {
+                      ASSERT_TRUE(*b);
+                    }
+                  },
+                  {"GET"});
+  router.AddRoute("/time/{}?t",
+                  [&](const HttpConnection::Ptr&, boost::gregorian::date date,
+                      boost::posix_time::ptime time) {
+                    index = 2;
+                    ASSERT_EQ(date, boost::gregorian::date(2024, 2, 29));
+                    auto time_of_day = boost::posix_time::hours(8) +
+                                       boost::posix_time::minutes(30) +
+                                       boost::posix_time::millisec(250);
+                    ASSERT_EQ(time,
+                              boost::posix_time::ptime(date, time_of_day));
+                  },
+                  {"GET"});
+  router.AddRoute("/point/{}",
+                  [&](const HttpConnection::Ptr&, Point point) {
+                    index = 3;
+                    ASSERT_EQ(point.x, 3);
+                    ASSERT_EQ(point.y, -4);
+                  },
+                  {"GET"});
+
+  index = 0;
+  router.Routing(conn, "GET", "/number/+5/1.5?b=true");
+  ASSERT_EQ(index, 1);
+
+  index = 0;
+  router.Routing(conn, "GET", "/time/2024-02-29?t=2024-02-29T08:30:00.25");
+  ASSERT_EQ(index, 2);
+
+  index = 0;
+  router.Routing(conn, "GET", "/point/3,-4");
+  ASSERT_EQ(index, 3);
+
+  const char* kBadTargets[] = {
+      "/number/32768/1.5",
+      "/number/5/1.5x",
+      "/number/5.0/1.5",
+      "/number/5/1.5?b=yes",
+      "/time/2023-02-29?t=2024-02-29",
+      "/time/2024-02-29?t=2024-02-29T24:00",
+      "/point/3",
+  };
+  for (auto target : kBadTargets) {
+    index = 0;
+    RouteError error = RouteError::kNone;
+    router.Routing(conn, "GET", target, error);
+    ASSERT_EQ(error, RouteError::kBadArgument) << target;
+    ASSERT_EQ(index, 0);
+  }
+}
+
+class Controller {
+ public:
+  Controller() noexcept { ++constructed; }
+
+  void Get(const HttpConnection::Ptr&, int id) {
+    ++called;
+    last_id = id;
+  }
+
+  static inline int constructed = 0;
+  int called = 0;
+  int last_id = 0;
+};
+
+TEST_F(HttpRouterTest, TestMemberFunctionRouting) {
+  auto controller = std::make_shared<Controller>();
+  Controller raw_controller;
+  router.AddRoute("/shared/{}", controller, &Controller::Get, {"GET"});
+  router.AddRoute("/raw/{}", &raw_controller, &Controller::Get, {"GET"});
+  router.AddRoute("/new/{}", &Controller::Get, {"GET"});
+
+  Controller::constructed = 0;
+  for (auto i = 0; i < 3; ++i) {
+    router.Routing(conn, "GET", "/shared/" + std::to_string(i));
+    router.Routing(conn, "GET", "/raw/" + std::to_string(i));
+  }
+  ASSERT_EQ(Controller::constructed, 0);
+  ASSERT_EQ(controller->called, 3);
+  ASSERT_EQ(controller->last_id, 2);
+  ASSERT_EQ(raw_controller.called, 3);
+
+  // Without an object every request gets a new one
+  router.Routing(conn, "GET", "/new/1");
+  ASSERT_EQ(Controller::constructed, 1);
+}
+
+TEST_F(HttpRouterTest, TestRestRouting) {
+  std::string rest;
+  router.AddRoute("/files/{*}",
+                  [&](const HttpConnection::Ptr&, std::string path) {
+                    rest = path;
+                  },
+                  {"GET"});
+  router.AddRoute("/files/index",
+                  [&](const HttpConnection::Ptr&) { rest = "index"; },
+                  {"GET"});
+
+  router.Routing(conn, "GET", "/files/a/b%20c/d.txt");
+  ASSERT_EQ(rest, "a/b c/d.txt");
+  router.Routing(conn, "GET", "/files/x");
+  ASSERT_EQ(rest, "x");
+  router.Routing(conn, "GET", "/files/index");
+  ASSERT_EQ(rest, "index");
+  router.Routing(conn, "GET", "/files/");
+  ASSERT_EQ(rest, "");
+
+  try {
+    router.Routing(conn, "GET", "/files");
+    FAIL() << "unreachable";
+  } catch (const std::exception& e) {
+    ASSERT_STREQ(e.what(), "Route not found");
+  }
+
+  try {
+    router.AddRoute("/files/{*}/x",
+                    [&](const HttpConnection::Ptr&, std::string) {}, {"GET"});
+    FAIL() << "unreachable";
+  } catch (const std::exception& e) {
+    ASSERT_STREQ(e.what(), "{*} must be the last segment");
+  }
+}